@@ -36,12 +36,12 @@ AABB::~AABB() {}
 // --------------------------------------------------------------------- inside
 // used to test if a ray starts inside a grid
 
-bool AABB::isInside(const Vector& p) 
+bool AABB::isInside(const Vector& p) const
 {
 	return ((p.x > min.x && p.x < max.x) && (p.y > min.y && p.y < max.y) && (p.z > min.z && p.z < max.z));
 }
 
-bool AABB::intercepts(const Ray& ray, float& t)
+bool AABB::intercepts(const Ray& ray, float& t) const
 {
 	float o_x = ray.origin.x;
 	float o_y = ray.origin.y;
@@ -97,6 +97,15 @@ bool AABB::intercepts(const Ray& ray, float& t)
 	return (t0 < t1 && t1 > 0.0001);
 }
 
+// --------------------------------------------------------------------- surface area
+// used by the SAH to estimate the probability of a ray hitting the box
+
+float AABB::area(void) const {
+	float dx = max.x - min.x, dy = max.y - min.y, dz = max.z - min.z;
+	if (dx < 0 || dy < 0 || dz < 0) return 0; // empty box
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
 Vector AABB::centroid(void) {
 	return (min + max) / 2;
 }
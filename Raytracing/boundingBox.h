@@ -16,9 +16,10 @@ public:
 	AABB(const AABB& bbox);
 	AABB operator= (const AABB& rhs);
 	
-	bool intercepts(const Ray& r, float& t);
-	bool isInside(const Vector& p);
+	bool intercepts(const Ray& r, float& t) const;
+	bool isInside(const Vector& p) const;
 	Vector centroid(void);
+	float area(void) const;
 	void extend(AABB box);
 };
 
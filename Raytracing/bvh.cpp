@@ -17,30 +17,77 @@ using namespace std;
 #include <chrono> 
 #include <queue> 
 #include <stack>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <string.h>
 #include "vector.h"
 #include "boundingBox.h"
 #include "scene.h"
+#include "config.h"
+#include "stats.h"
+#include "platform.h"
 
 #ifndef M_PI 
 #define M_PI (3.14159265358979323846) 
 #endif 
 
-class BVH
+// SIMD child box tests for the wide (4/8 children) BVHs. Without SSE the scalar path is used
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BVH_USE_SSE
+#include <xmmintrin.h>
+#endif
+#if defined(__AVX__)
+#define BVH_USE_AVX
+#include <immintrin.h>
+#endif
+
+// Array whose storage starts at a cache line (64 byte) boundary
+template <class T>
+class AlignedArray
 {
-	class Comparator {
-	public:
-		int dimension;
+	unsigned char* memory = nullptr;
+	T* data = nullptr;
+	int n = 0;
 
-		bool operator() (Object* a, Object* b) {
-			AABB box;
-			box = a->GetBoundingBox();
-			float ca = (box.max.getIndex(dimension) + box.min.getIndex(dimension)) * 0.5f;
-			box = b->GetBoundingBox();
-			float cb = (box.max.getIndex(dimension) + box.min.getIndex(dimension)) * 0.5f;
-			return ca < cb;
-		}
-	};
+public:
+	AlignedArray() {}
+	AlignedArray(const AlignedArray&) = delete;
+	AlignedArray& operator=(const AlignedArray&) = delete;
+	~AlignedArray() { delete[] memory; }
+
+	// discards the previous contents
+	void resize(int n_) {
+		delete[] memory;
+		n = n_;
+		memory = new unsigned char[n * sizeof(T) + 63];
+		data = (T*)(((uintptr_t)memory + 63) & ~(uintptr_t)63);
+	}
 
+	// uses the n_ elements at data_ (64 byte aligned, e.g. in a mapped file) in place, without owning them
+	void view(T* data_, int n_) {
+		delete[] memory;
+		memory = nullptr;
+		data = data_;
+		n = n_;
+	}
+
+	int size() const { return n; }
+	T& operator[](int i) { return data[i]; }
+	const T& operator[](int i) const { return data[i]; }
+};
+
+// Per ray results of BVH::intersect_packet (arrays with one entry per ray of the packet)
+struct HitRecordSet {
+	Object** objs;	// NULL -> no intersection
+	Vector* points;
+	float* t;
+};
+
+class BVH
+{
 	class BVHNode {
 	private:
 		AABB bbox;
@@ -66,53 +113,1011 @@ class BVH
 			this->n_objs = n_objs_; 
 		}
 
-		bool isLeaf() { return leaf; }
-		unsigned int getIndex() { return index; }
-		unsigned int getNObjs() { return n_objs; }
+		bool isLeaf() const { return leaf; }
+		unsigned int getIndex() const { return index; }
+		unsigned int getNObjs() const { return n_objs; }
 		AABB &getAABB() { return bbox; };
+		const AABB &getAABB() const { return bbox; };
+
+	};
 
+	// Compact node used for traversal: 32 bytes (two nodes per cache line), stored depth first in one array.
+	// The first child of an interior node is the next node, "offset" points to the second one.
+	// For leaves "offset" is the first object and the count holds the number of objects plus the LEAF_FLAG bit
+	struct alignas(32) LinearBVHNode {
+		float bmin[3];
+		unsigned int offset;
+		float bmax[3];
+		unsigned int count;
+	};
+
+	static const unsigned int LEAF_FLAG = 0x80000000u;
+
+	// Node of the collapsed wide BVH (W = 4 or 8 children). The child boxes are stored SoA
+	// (bounds[min/max][axis][child]) so one SIMD slab test checks all the children against a ray.
+	// Per child, offset/count have the same meaning as in LinearBVHNode (offset = wide node index for
+	// interior children). Unused slots are inverted boxes, which never hit
+	template <int W>
+	struct alignas(64) WideBVHNode {
+		float bounds[2][3][W];
+		unsigned int offset[W];
+		unsigned int count[W];
 	};
 
 	struct StackItem {
-		BVHNode* ptr;
+		int node;
+		float t;
+	};
+
+	// Pending child of a wide node, either an inner node or a leaf
+	struct WideStackItem {
+		unsigned int offset;
+		unsigned int count;
 		float t;
+	};
 
-		StackItem(BVHNode* _ptr, float _t) : ptr(_ptr), t(_t) { }
+	// Ray data shared by all the wide node tests of one traversal
+	struct WideRay {
+		float origin[3];
+		float inv_dir[3];
+		int near_side[3];	// 0 -> the entry plane of the axis is the box min, 1 -> it is the max
+	};
+
+	// Maximum depth of the tree. The traversal keeps at most one pending node per level,
+	// so this is also the size of the (on-stack) traversal stack
+	static const int MAX_TREE_DEPTH = 64;
+
+	// Pending node of a packet traversal, with the first ray of the packet still active in it
+	struct PacketStackItem {
+		int node;
+		int first;
+	};
+
+	// Bounds and centroid of an object, computed once per build (the builders never call the objects)
+	struct PrimInfo {
+		Object* obj;
+		AABB bbox;
+		Vector centroid;
+		bool clippable;	// SBVH: the object can be clipped by the split planes
+	};
+
+	class Comparator {
+	public:
+		int dimension;
+
+		bool operator() (PrimInfo& a, PrimInfo& b) {
+			return a.centroid.getIndex(dimension) < b.centroid.getIndex(dimension);
+		}
+	};
+
+	struct SAHBin {
+		AABB bbox;
+		int count;
+	};
+
+	// Best binned SAH object split of some prims: bin boundary "bin" of the axis (-1 -> the centroids can't be separated)
+	struct ObjectSplit {
+		float cost;
+		int axis, bin;
+		float c_min[3], extent[3];	// the bins are laid over the centroid bounds
+		AABB left_bbox, right_bbox;
+	};
+
+	// SBVH spatial bin: bounds of the parts of the references inside it, references that start and end in it
+	struct SpatialBin {
+		AABB bbox;
+		int enter, exit;
+	};
+
+	// Best spatial split: plane at bin boundary "bin" of the axis (-1 -> none), laid over the node bounds
+	struct SpatialSplit {
+		float cost;
+		int axis, bin;
+		float b_min, extent;
+		AABB left_bbox, right_bbox;
+		int n_left, n_right;
 	};
 
 	int Threshold = 2;
+	int depth = 0;	// depth of the built tree
 	vector<Object*> objs;
-	vector<BVHNode*> nodes;
-	stack<StackItem> hit_stack;
+	vector<BVHNode*> nodes;	// only used while building, the children of a node are allocated together (n_build_nodes)
+
+	AlignedArray<LinearBVHNode> flat_nodes;
+	int n_flat_nodes = 0;
+
+	int width = 2;	// children per node used by the traversal: 2 (flat_nodes), 4 (wide4) or 8 (wide8)
+	AlignedArray<WideBVHNode<4> > wide4;
+	AlignedArray<WideBVHNode<8> > wide8;
+	int n_wide_nodes = 0;
+
+	bvh_builder builder = bvh_builder::Midpoint;
+	int sah_bins = 12;
+	float sah_traversal_cost = 1.0f;	// cost of visiting an interior node
+	float sah_intersection_cost = 1.0f;	// cost of each primitive test in a leaf
+	int sah_max_leaf = 8;				// leaves larger than this are split even if the SAH disagrees
+	float sbvh_alpha = 1e-5f;			// SBVH: min overlap of the object split children (over the root area) to try a spatial split
+	float sbvh_max_duplication = 1.0f;	// SBVH: max references added by the spatial splits, per object
+	int sbvh_max_refs = 0;
+	int n_sbvh_refs = 0;
+	int n_spatial_splits = 0;
+	float sbvh_root_area = 0;
+	vector<PrimInfo> prims;	// SBVH: references, an object can have several (each with the bounds of a part of it)
+	vector<uint64_t> morton;	// LBVH: Morton code of every prim, sorted
+
+	// Parallel build: subtrees of at least PARALLEL_TASK_MIN objects are built by a thread of their own while fewer
+	// than build_threads are working, nodes of at least PARALLEL_BIN_MIN objects are binned by all the threads.
+	// Both builders make the same tree with any number of threads
+	static const int PARALLEL_TASK_MIN = 4096;
+	static const int PARALLEL_BIN_MIN = 32768;
+	int build_threads = 1;
+	atomic<int> build_tasks{ 0 };	// running subtree threads
+	atomic<int> n_build_nodes{ 0 };
+	atomic<int> build_depth{ 0 };
+
+	// Cache file: this header, then the object index of every reference (int32), the binary nodes and the wide
+	// nodes, each at a 64 byte aligned offset and in the layout of the traversal, so they are used in place
+	struct CacheHeader {
+		char magic[4];
+		uint32_t version;
+		uint64_t geometry_hash;
+		int32_t n_objects;
+		int32_t builder, width, sah_bins, sah_max_leaf;	// build settings: another tree if any of them changes
+		float sah_traversal_cost, sah_intersection_cost, sbvh_alpha, sbvh_max_duplication;
+		int32_t node_size, wide_node_size;	// node layouts of the program that wrote the file
+		int32_t depth, n_refs, n_flat_nodes, n_wide_nodes;
+		uint64_t refs_offset, flat_offset, wide_offset;
+	};
+
+	MappedFile cache;	// the cache file the nodes are mapped from (if loaded)
+
+	friend int kernelBenchmark(int n_tests);	// times the node tests on their own
 
 	public:
+		BVH() {}
+		BVH(const BVH&) = delete;
+		BVH& operator=(const BVH&) = delete;
+
+		void setBuilder(bvh_builder builder_) { builder = builder_; }
+
+		void setBuildThreads(int threads) { build_threads = (threads > 1) ? threads : 1; }
+
+		// 2 -> binary BVH, 4 or 8 -> the binary tree is collapsed into a wide BVH after building
+		void setWidth(int width_) { width = (width_ == 4 || width_ == 8) ? width_ : 2; }
+
+		void setSAHParams(int bins, float traversal_cost, float intersection_cost, int max_leaf) {
+			sah_bins = bins;
+			sah_traversal_cost = traversal_cost;
+			sah_intersection_cost = intersection_cost;
+			sah_max_leaf = max_leaf;
+		}
+
+		void setSpatialSplits(float alpha, float max_duplication) {
+			sbvh_alpha = alpha;
+			sbvh_max_duplication = max_duplication;
+		}
+
 		void build(vector<Object *> &objects) {
-			nodes = vector<BVHNode*>();
-			nodes.reserve(objects.size());
+			auto timeStart = chrono::high_resolution_clock::now();
+
+			for (BVHNode* node : nodes) delete node;
+			objs = objects;
+			depth = 0;
+			int n_objects = objs.size();
+			cache.close();	// the arrays are rebuilt before the traversal reads them again
+
+			// the bounds of every object, once
+			prims.resize(objs.size());
+			parallelChunks(0, objs.size(), buildChunks(objs.size()), [&](int /*chunk*/, int first, int last) {
+				for (int i = first; i < last; i++) {
+					prims[i].obj = objs[i];
+					prims[i].bbox = objs[i]->GetBoundingBox();
+					prims[i].centroid = prims[i].bbox.centroid();
+				}
+			});
 
 			BVHNode *root = new BVHNode();
 
 			Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 			AABB final_bbox = AABB(min, max);
 
-			for (Object* obj : objects) {
-				AABB bbox = obj->GetBoundingBox();
-				final_bbox.extend(bbox);
-				objs.push_back(obj);
-			}
+			for (PrimInfo& prim : prims) final_bbox.extend(prim.bbox);
 
 			root->setAABB(final_bbox);
 			root->makeNode(0);
-			nodes.push_back(root);
 
-			build_recursive(0, objs.size(), root);
+			// a binary tree with at most one leaf per reference
+			int max_refs = n_objects;
+			if (builder == bvh_builder::Sbvh) max_refs += (int)(n_objects * sbvh_max_duplication);
+			nodes.assign(MAX(max_refs * 2 - 1, 1), NULL);
+			nodes[0] = root;
+			n_build_nodes = 1;
+			build_depth = 0;
+			build_tasks = 0;
+
+			if (builder == bvh_builder::Lbvh) sort_morton();
+
+			if (builder == bvh_builder::Sbvh) build_sbvh(root, max_refs);
+			else build_subtree(0, objs.size(), root, 1);
+
+			nodes.resize(n_build_nodes);
+			if (builder == bvh_builder::Lbvh) {
+				refit(root);
+				morton = vector<uint64_t>();
+			}
+			depth = build_depth;
+			objs.resize(prims.size());
+			for (size_t i = 0; i < objs.size(); i++) objs[i] = prims[i].obj;
+			prims = vector<PrimInfo>();
+
+			flatten();
+
+			n_wide_nodes = 0;
+			if (width == 4) collapse<4>(wide4);
+			else if (width == 8) collapse<8>(wide8);
+
+			auto timeEnd = chrono::high_resolution_clock::now();
+			double build_ms = chrono::duration<double, milli>(timeEnd - timeStart).count();
+
+			// the spatial split builder runs on a single thread
+			printf("BVH (%s, %d build threads): %d objects, %d nodes, depth %d, build %.2f ms, SAH cost %.2f\n",
+				builderName(builder), (builder == bvh_builder::Sbvh) ? 1 : build_threads, n_objects, n_flat_nodes, depth,
+				build_ms, getSAHCost());
+			if (builder == bvh_builder::Sbvh) printf("SBVH: %d references (+%.1f%%), %d spatial splits\n",
+				(int)objs.size(), 100.0 * ((int)objs.size() - n_objects) / MAX(n_objects, 1), n_spatial_splits);
+			if (width > 2) printf("BVH%d: %d nodes\n", width, n_wide_nodes);
+		}
+
+		~BVH() {
+			for (BVHNode* node : nodes) delete node;
+		}
+
+		// Saves the built tree to a cache file for the objects (their index in objects) of the scene geometry
+		// with that hash. Written to filename.tmp and then renamed, so a failed write leaves no partial file
+		bool save(const char* filename, uint64_t geometry_hash, const vector<Object*>& objects) const {
+			unordered_map<Object*, int32_t> index;
+			for (size_t i = 0; i < objects.size(); i++) index[objects[i]] = (int32_t)i;
+
+			vector<int32_t> refs(objs.size());
+			for (size_t i = 0; i < objs.size(); i++) refs[i] = index[objs[i]];
+
+			CacheHeader header;
+			setCacheHeader(header, geometry_hash, (int)objects.size());
+			header.depth = depth;
+			header.n_refs = refs.size();
+			header.n_flat_nodes = n_flat_nodes;
+			header.n_wide_nodes = n_wide_nodes;
+			header.refs_offset = align64(sizeof(CacheHeader));
+			header.flat_offset = align64(header.refs_offset + refs.size() * sizeof(int32_t));
+			header.wide_offset = align64(header.flat_offset + (uint64_t)n_flat_nodes * sizeof(LinearBVHNode));
+
+			const void* wide_nodes = (width == 4) ? (const void*)&wide4[0] : (width == 8) ? (const void*)&wide8[0] : NULL;
+			size_t wide_bytes = (size_t)n_wide_nodes * header.wide_node_size;
+
+			string tmp = string(filename) + ".tmp";
+			FILE* file = fopen(tmp.c_str(), "wb");
+			if (file == NULL) return false;
+
+			bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+				&& writeAt(file, header.refs_offset, refs.data(), refs.size() * sizeof(int32_t))
+				&& writeAt(file, header.flat_offset, &flat_nodes[0], n_flat_nodes * sizeof(LinearBVHNode))
+				&& (wide_bytes == 0 || writeAt(file, header.wide_offset, wide_nodes, wide_bytes));
+
+			ok = (fclose(file) == 0) && ok;
+			if (!ok) {
+				remove(tmp.c_str());
+				return false;
+			}
+
+			// rename doesn't replace an existing file on Windows
+			remove(filename);
+			return rename(tmp.c_str(), filename) == 0;
+		}
+
+		// Loads the tree from a cache file instead of building it: the nodes are used in place from the mapped file.
+		// false (and nothing loaded) if there is no cache file, or it is of other geometry or build settings, of
+		// another version or node layout, or is not a valid tree
+		bool load(const char* filename, uint64_t geometry_hash, const vector<Object*>& objects) {
+			auto timeStart = chrono::high_resolution_clock::now();
+
+			MappedFile file;
+			if (!file.open(filename) || file.size() < sizeof(CacheHeader)) return false;
+
+			CacheHeader header, expected;
+			memcpy(&header, file.data(), sizeof(header));
+			setCacheHeader(expected, geometry_hash, (int)objects.size());
+
+			// the settings are compared as their bytes, up to the fields of the tree itself
+			if (memcmp(&header, &expected, offsetof(CacheHeader, depth)) != 0) return false;
+			if (!validCache(header, file)) return false;
+
+			for (BVHNode* node : nodes) delete node;
+			nodes = vector<BVHNode*>();
+
+			const int32_t* refs = (const int32_t*)(file.data() + header.refs_offset);
+			objs.resize(header.n_refs);
+			for (int i = 0; i < header.n_refs; i++) objs[i] = objects[refs[i]];
+
+			// read only pages: the traversal never writes the nodes
+			n_flat_nodes = header.n_flat_nodes;
+			flat_nodes.view((LinearBVHNode*)(file.data() + header.flat_offset), n_flat_nodes);
+			n_wide_nodes = header.n_wide_nodes;
+			if (width == 4) wide4.view((WideBVHNode<4>*)(file.data() + header.wide_offset), n_wide_nodes);
+			else if (width == 8) wide8.view((WideBVHNode<8>*)(file.data() + header.wide_offset), n_wide_nodes);
+			depth = header.depth;
+
+			cache.swap(file);	// the previous cache (if any) is unmapped with file
+
+			auto timeEnd = chrono::high_resolution_clock::now();
+			double load_ms = chrono::duration<double, milli>(timeEnd - timeStart).count();
+
+			printf("BVH (%s, cached): %d objects, %d nodes, depth %d, load %.2f ms from %s, SAH cost %.2f\n",
+				builderName(builder), (int)objects.size(), n_flat_nodes, depth, load_ms, filename, getSAHCost());
+			if (width > 2) printf("BVH%d: %d nodes\n", width, n_wide_nodes);
+			return true;
+		}
+
+		// Header fields that key the cache: format, geometry and build settings
+		void setCacheHeader(CacheHeader& header, uint64_t geometry_hash, int n_objects) const {
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, "RTBV", 4);
+			header.version = 1;
+			header.geometry_hash = geometry_hash;
+			header.n_objects = n_objects;
+			header.builder = builder;
+			header.width = width;
+			header.sah_bins = sah_bins;
+			header.sah_max_leaf = sah_max_leaf;
+			header.sah_traversal_cost = sah_traversal_cost;
+			header.sah_intersection_cost = sah_intersection_cost;
+			header.sbvh_alpha = sbvh_alpha;
+			header.sbvh_max_duplication = sbvh_max_duplication;
+			header.node_size = sizeof(LinearBVHNode);
+			header.wide_node_size = (width == 4) ? sizeof(WideBVHNode<4>) : (width == 8) ? sizeof(WideBVHNode<8>) : 0;
+		}
+
+		// The sections fit in the file and the trees are well formed: every index in range, children after their
+		// parent and no deeper than the traversal stacks allow. A corrupted file is rebuilt rather than traversed
+		bool validCache(const CacheHeader& header, const MappedFile& file) const {
+			uint64_t wide_size = (width > 2) ? (uint64_t)header.wide_node_size : 0;
+
+			if (header.n_refs < 0 || header.n_flat_nodes <= 0 || header.n_wide_nodes < 0) return false;
+			if (header.depth < 0 || header.depth > MAX_TREE_DEPTH) return false;
+			if (header.refs_offset % 64 || header.flat_offset % 64 || header.wide_offset % 64) return false;
+			if (header.refs_offset + (uint64_t)header.n_refs * sizeof(int32_t) > file.size() ||
+				header.flat_offset + (uint64_t)header.n_flat_nodes * sizeof(LinearBVHNode) > file.size() ||
+				(header.n_wide_nodes > 0 && header.wide_offset + (uint64_t)header.n_wide_nodes * wide_size > file.size())) return false;
+			if ((width > 2) != (header.n_wide_nodes > 0)) return false;
+
+			const int32_t* refs = (const int32_t*)(file.data() + header.refs_offset);
+			for (int i = 0; i < header.n_refs; i++) {
+				if (refs[i] < 0 || refs[i] >= header.n_objects) return false;
+			}
+
+			const LinearBVHNode* flat = (const LinearBVHNode*)(file.data() + header.flat_offset);
+			vector<unsigned char> node_depth(header.n_flat_nodes, 0);
+			node_depth[0] = 1;
+			for (int i = 0; i < header.n_flat_nodes; i++) {
+				if (node_depth[i] == 0 || node_depth[i] > MAX_TREE_DEPTH) return false; // unreachable or too deep
+				if (flat[i].count & LEAF_FLAG) {
+					if ((uint64_t)flat[i].offset + (flat[i].count & ~LEAF_FLAG) > (uint64_t)header.n_refs) return false;
+				}
+				else {
+					if (flat[i].count != 0 || flat[i].offset <= (unsigned int)i + 1 || flat[i].offset >= (unsigned int)header.n_flat_nodes) return false;
+					// every node has one parent, so its depth is the one it is reached with
+					if (node_depth[i + 1] != 0 || node_depth[flat[i].offset] != 0) return false;
+					node_depth[i + 1] = node_depth[flat[i].offset] = node_depth[i] + 1;
+				}
+			}
+
+			if (width == 4) return validWide<4>(header, file);
+			if (width == 8) return validWide<8>(header, file);
+			return true;
+		}
+
+		template <int W>
+		bool validWide(const CacheHeader& header, const MappedFile& file) const {
+			const WideBVHNode<W>* wide = (const WideBVHNode<W>*)(file.data() + header.wide_offset);
+			vector<unsigned char> node_depth(header.n_wide_nodes, 0);
+			node_depth[0] = 1;
+			for (int i = 0; i < header.n_wide_nodes; i++) {
+				if (node_depth[i] == 0 || node_depth[i] > MAX_TREE_DEPTH) return false;
+				for (int c = 0; c < W; c++) {
+					if (wide[i].count[c] & LEAF_FLAG) {
+						if ((uint64_t)wide[i].offset[c] + (wide[i].count[c] & ~LEAF_FLAG) > (uint64_t)header.n_refs) return false;
+					}
+					else {
+						if (wide[i].count[c] != 0 || wide[i].offset[c] <= (unsigned int)i || wide[i].offset[c] >= (unsigned int)header.n_wide_nodes) return false;
+						if (node_depth[wide[i].offset[c]] != 0) return false;	// a second parent
+						node_depth[wide[i].offset[c]] = node_depth[i] + 1;
+					}
+				}
+			}
+			return true;
+		}
+
+		static uint64_t align64(uint64_t offset) { return (offset + 63) & ~(uint64_t)63; }
+
+		// Writes size bytes at offset (past the end of the file, which is zero padded up to it)
+		static bool writeAt(FILE* file, uint64_t offset, const void* data, size_t size) {
+			static const char zeros[64] = { 0 };
+			long position = ftell(file);
+			if (position < 0 || (uint64_t)position > offset || offset - position > sizeof(zeros)) return false;
+			return fwrite(zeros, 1, offset - position, file) == offset - position && fwrite(data, 1, size, file) == size;
+		}
+
+		// Copies the built tree into the contiguous depth first array and releases the build nodes
+		void flatten() {
+			n_flat_nodes = nodes.size();
+			flat_nodes.resize(n_flat_nodes);
+
+			int next = 0;
+			flatten_recursive(nodes[0], next);
+
+			for (BVHNode* node : nodes) delete node;
+			nodes = vector<BVHNode*>();
+		}
+
+		int flatten_recursive(const BVHNode* node, int& next) {
+			int index = next++;
+			LinearBVHNode& flat = flat_nodes[index];
+			const AABB& bbox = node->getAABB();
+
+			flat.bmin[0] = bbox.min.x; flat.bmin[1] = bbox.min.y; flat.bmin[2] = bbox.min.z;
+			flat.bmax[0] = bbox.max.x; flat.bmax[1] = bbox.max.y; flat.bmax[2] = bbox.max.z;
+
+			if (node->isLeaf()) {
+				flat.offset = node->getIndex();
+				flat.count = LEAF_FLAG | node->getNObjs();
+			}
+			else {
+				flatten_recursive(nodes[node->getIndex()], next); // first child right after its parent
+				flat_nodes[index].offset = flatten_recursive(nodes[node->getIndex() + 1], next);
+				flat_nodes[index].count = 0;
+			}
+			return index;
+		}
+
+		// Slab test of a node against a ray (with precomputed inverse direction), t is the entry distance
+		static bool intersect_node(const LinearBVHNode& node, const Vector& origin, const float* inv_dir, float& t) {
+			float tx0 = (node.bmin[0] - origin.x) * inv_dir[0], tx1 = (node.bmax[0] - origin.x) * inv_dir[0];
+			float ty0 = (node.bmin[1] - origin.y) * inv_dir[1], ty1 = (node.bmax[1] - origin.y) * inv_dir[1];
+			float tz0 = (node.bmin[2] - origin.z) * inv_dir[2], tz1 = (node.bmax[2] - origin.z) * inv_dir[2];
+
+			float t0 = MAX3(MIN(tx0, tx1), MIN(ty0, ty1), MIN(tz0, tz1));
+			float t1 = MIN3(MAX(tx0, tx1), MAX(ty0, ty1), MAX(tz0, tz1));
+
+			t = (t0 < 0) ? 0 : t0; // a ray starting inside the box enters it at 0
+			return (t0 < t1 && t1 > 0.0001);
+		}
+
+		int getDepth() const { return depth; }
+
+		// Storage of the traversal: object references and nodes
+		size_t memoryBytes() const {
+			return objs.capacity() * sizeof(Object*) + flat_nodes.size() * sizeof(LinearBVHNode) +
+				wide4.size() * sizeof(WideBVHNode<4>) + wide8.size() * sizeof(WideBVHNode<8>);
+		}
+
+		// Collapses the binary tree into a W wide one: each wide node takes the children of a binary node
+		// and keeps opening its largest (by surface area) inner child until it has W children
+		template <int W>
+		void collapse(AlignedArray<WideBVHNode<W> >& wide) {
+			wide.resize(n_flat_nodes > 0 ? n_flat_nodes : 1); // never more wide nodes than binary ones
+			collapse_recursive<W>(wide, 0);
+		}
+
+		template <int W>
+		int collapse_recursive(AlignedArray<WideBVHNode<W> >& wide, int bin_node) {
+			int children[W];
+			int n_children = 0;
+
+			if (flat_nodes[bin_node].count & LEAF_FLAG) {
+				children[n_children++] = bin_node; // only when the root is a leaf
+			}
+			else {
+				children[n_children++] = bin_node + 1;
+				children[n_children++] = flat_nodes[bin_node].offset;
+			}
+
+			while (n_children < W) {
+				int largest = -1;
+				float largest_area = -1;
+
+				for (int i = 0; i < n_children; i++) {
+					if (flat_nodes[children[i]].count & LEAF_FLAG) continue;
+
+					float area = nodeArea(flat_nodes[children[i]]);
+					if (area > largest_area) {
+						largest_area = area;
+						largest = i;
+					}
+				}
+
+				if (largest == -1) break; // only leaves left
+
+				int opened = children[largest];
+				children[largest] = opened + 1;
+				children[n_children++] = flat_nodes[opened].offset;
+			}
+
+			int index = n_wide_nodes++;
+
+			for (int i = 0; i < W; i++) {
+				for (int axis = 0; axis < 3; axis++) {
+					wide[index].bounds[0][axis][i] = (i < n_children) ? flat_nodes[children[i]].bmin[axis] : FLT_MAX;
+					wide[index].bounds[1][axis][i] = (i < n_children) ? flat_nodes[children[i]].bmax[axis] : -FLT_MAX;
+				}
+				wide[index].offset[i] = 0;
+				wide[index].count[i] = LEAF_FLAG;
+			}
+
+			for (int i = 0; i < n_children; i++) {
+				const LinearBVHNode& child = flat_nodes[children[i]];
+
+				if (child.count & LEAF_FLAG) {
+					wide[index].offset[i] = child.offset;
+					wide[index].count[i] = child.count;
+				}
+				else {
+					int child_index = collapse_recursive<W>(wide, children[i]);
+					wide[index].offset[i] = child_index;
+					wide[index].count[i] = 0;
+				}
+			}
+
+			return index;
+		}
+
+		static WideRay makeWideRay(const Ray& ray) {
+			WideRay wray;
+			float dir[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+			float org[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+
+			for (int axis = 0; axis < 3; axis++) {
+				wray.origin[axis] = org[axis];
+				wray.inv_dir[axis] = 1.0f / dir[axis];
+				wray.near_side[axis] = (wray.inv_dir[axis] >= 0) ? 0 : 1;
+			}
+			return wray;
+		}
+
+		// Tests 4 children boxes (starting at child "first") against the ray, returns the hit mask and their entry distances.
+		// Picking the entry/exit planes by the ray direction sign makes inverted (empty) boxes always miss
+		template <int W>
+		static int intersect_children4(const WideBVHNode<W>& node, int first, const WideRay& ray, float tmax, float* t_out) {
+#ifdef BVH_USE_SSE
+			__m128 t0 = _mm_setzero_ps();
+			__m128 t1 = _mm_set1_ps(FLT_MAX);
+
+			for (int axis = 0; axis < 3; axis++) {
+				__m128 org = _mm_set1_ps(ray.origin[axis]);
+				__m128 inv = _mm_set1_ps(ray.inv_dir[axis]);
+				__m128 t_near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray.near_side[axis]][axis][first]), org), inv);
+				__m128 t_far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[1 - ray.near_side[axis]][axis][first]), org), inv);
+				t0 = _mm_max_ps(t0, t_near);
+				t1 = _mm_min_ps(t1, t_far);
+			}
+
+			// t0 < t1, exit past the epsilon and entry before the closest hit found so far
+			__m128 mask = _mm_and_ps(_mm_cmplt_ps(t0, t1), _mm_cmpgt_ps(t1, _mm_set1_ps(0.0001f)));
+			mask = _mm_and_ps(mask, _mm_cmplt_ps(t0, _mm_set1_ps(tmax)));
+
+			_mm_storeu_ps(t_out, t0);
+			return _mm_movemask_ps(mask);
+#else
+			int mask = 0;
+			for (int i = 0; i < 4; i++) {
+				float t0 = 0, t1 = FLT_MAX;
+				for (int axis = 0; axis < 3; axis++) {
+					float t_near = (node.bounds[ray.near_side[axis]][axis][first + i] - ray.origin[axis]) * ray.inv_dir[axis];
+					float t_far = (node.bounds[1 - ray.near_side[axis]][axis][first + i] - ray.origin[axis]) * ray.inv_dir[axis];
+					t0 = MAX(t0, t_near);
+					t1 = MIN(t1, t_far);
+				}
+				t_out[i] = t0;
+				if (t0 < t1 && t1 > 0.0001f && t0 < tmax) mask |= 1 << i;
+			}
+			return mask;
+#endif
+		}
+
+		static int intersect_children(const WideBVHNode<4>& node, const WideRay& ray, float tmax, float* t_out) {
+			return intersect_children4<4>(node, 0, ray, tmax, t_out);
+		}
+
+		static int intersect_children(const WideBVHNode<8>& node, const WideRay& ray, float tmax, float* t_out) {
+#ifdef BVH_USE_AVX
+			__m256 t0 = _mm256_setzero_ps();
+			__m256 t1 = _mm256_set1_ps(FLT_MAX);
+
+			for (int axis = 0; axis < 3; axis++) {
+				__m256 org = _mm256_set1_ps(ray.origin[axis]);
+				__m256 inv = _mm256_set1_ps(ray.inv_dir[axis]);
+				__m256 t_near = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.near_side[axis]][axis]), org), inv);
+				__m256 t_far = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - ray.near_side[axis]][axis]), org), inv);
+				t0 = _mm256_max_ps(t0, t_near);
+				t1 = _mm256_min_ps(t1, t_far);
+			}
+
+			__m256 mask = _mm256_and_ps(_mm256_cmp_ps(t0, t1, _CMP_LT_OQ), _mm256_cmp_ps(t1, _mm256_set1_ps(0.0001f), _CMP_GT_OQ));
+			mask = _mm256_and_ps(mask, _mm256_cmp_ps(t0, _mm256_set1_ps(tmax), _CMP_LT_OQ));
+
+			_mm256_storeu_ps(t_out, t0);
+			return _mm256_movemask_ps(mask);
+#else
+			// two 4 wide halves
+			return intersect_children4<8>(node, 0, ray, tmax, t_out) | (intersect_children4<8>(node, 4, ray, tmax, t_out + 4) << 4);
+#endif
+		}
+
+		// Closest hit through the wide BVH. Hit children are pushed far to near, so they are visited front to back
+		template <int W>
+		bool intersect_wide(const AlignedArray<WideBVHNode<W> >& wide, Ray& ray, Object** hit_obj, Vector& hit_point) const {
+			float tmin = FLT_MAX;
+			bool hit = false;
+			uint64_t visits = 0;
+
+			WideStackItem hit_stack[MAX_TREE_DEPTH * (W - 1) + 1];
+			int stack_size = 0;
+
+			WideRay wray = makeWideRay(ray);
+			hit_stack[stack_size++] = { 0, 0, 0.0f };
+
+			while (stack_size > 0) {
+				WideStackItem item = hit_stack[--stack_size];
+
+				if (item.t >= tmin) continue;
+
+				if (item.count & LEAF_FLAG) {
+					Object* obj;
+					float curr_t;
+					unsigned int last = item.offset + (item.count & ~LEAF_FLAG);
+					for (unsigned int i = item.offset; i < last; i++) {
+						obj = objs[i];
+						if (obj->intercepts(ray, curr_t) && curr_t < tmin) {
+							tmin = curr_t;
+							*hit_obj = obj;
+							hit = true;
+						}
+					}
+					continue;
+				}
+
+				visits++;
+				const WideBVHNode<W>& node = wide[item.offset];
+
+				float t[W];
+				int mask = intersect_children(node, wray, tmin, t);
+
+				// hit children sorted by decreasing distance (insertion sort, at most W of them)
+				int first = stack_size;
+				for (int i = 0; i < W; i++) {
+					if (!(mask & (1 << i))) continue;
+
+					WideStackItem child = { node.offset[i], node.count[i], t[i] };
+					int j = stack_size++;
+					while (j > first && hit_stack[j - 1].t < child.t) {
+						hit_stack[j] = hit_stack[j - 1];
+						j--;
+					}
+					hit_stack[j] = child;
+				}
+			}
+
+			STAT(BvhNodes, visits);
+
+			if (hit) {
+				hit_point = ray.direction * tmin + ray.origin;
+			}
+			return hit;
+		}
+
+		// Any hit through the wide BVH (no ordering needed)
+		template <int W>
+		bool bool_intersect_wide(const AlignedArray<WideBVHNode<W> >& wide, Ray& ray) const {
+			uint64_t visits = 0;
+
+			WideStackItem hit_stack[MAX_TREE_DEPTH * (W - 1) + 1];
+			int stack_size = 0;
+
+			WideRay wray = makeWideRay(ray);
+			hit_stack[stack_size++] = { 0, 0, 0.0f };
+
+			while (stack_size > 0) {
+				WideStackItem item = hit_stack[--stack_size];
+
+				if (item.count & LEAF_FLAG) {
+					float curr_t;
+					unsigned int last = item.offset + (item.count & ~LEAF_FLAG);
+					for (unsigned int i = item.offset; i < last; i++) {
+						if (objs[i]->intercepts(ray, curr_t)) {
+							STAT(BvhNodes, visits);
+							return true;
+						}
+					}
+					continue;
+				}
+
+				visits++;
+				const WideBVHNode<W>& node = wide[item.offset];
+
+				float t[W];
+				int mask = intersect_children(node, wray, FLT_MAX, t);
+
+				for (int i = 0; i < W; i++) {
+					if (mask & (1 << i)) hit_stack[stack_size++] = { node.offset[i], node.count[i], t[i] };
+				}
+			}
+
+			STAT(BvhNodes, visits);
+			return false;
+		}
+
+		// Estimated cost of tracing a ray through the tree (surface area heuristic), usefull to compare builders
+		float getSAHCost() const {
+			float root_area = nodeArea(flat_nodes[0]);
+			if (root_area <= 0) return 0;
+
+			float cost = 0;
+			for (int i = 0; i < n_flat_nodes; i++) {
+				float p = nodeArea(flat_nodes[i]) / root_area;
+				if (flat_nodes[i].count & LEAF_FLAG) cost += p * (flat_nodes[i].count & ~LEAF_FLAG) * sah_intersection_cost;
+				else cost += p * sah_traversal_cost;
+			}
+			return cost;
+		}
+
+		static float nodeArea(const LinearBVHNode& node) {
+			return AABB(Vector(node.bmin[0], node.bmin[1], node.bmin[2]), Vector(node.bmax[0], node.bmax[1], node.bmax[2])).area();
+		}
+
+		// Builds the subtree of node over prims [left_index, right_index[ with the chosen builder
+		void build_subtree(int left_index, int right_index, BVHNode* node, int node_depth) {
+			if (builder == bvh_builder::Sah) build_recursive_sah(left_index, right_index, node, node_depth);
+			else if (builder == bvh_builder::Lbvh) build_recursive_lbvh(left_index, right_index, node, node_depth);
+			else build_recursive(left_index, right_index, node, node_depth);
+		}
+
+		// Builds both children of a node, the left one on a new thread if both are large and fewer than
+		// build_threads are working
+		void build_children(int left_index, int mid, BVHNode* left_node, int right_index, BVHNode* right_node, int node_depth) {
+			bool task = false;
+			if (build_threads > 1 && mid - left_index >= PARALLEL_TASK_MIN && right_index - mid >= PARALLEL_TASK_MIN) {
+				task = build_tasks.fetch_add(1) < build_threads - 1;
+				if (!task) build_tasks--;
+			}
+
+			if (task) {
+				thread worker([this, left_index, mid, left_node, node_depth]() {
+					build_subtree(left_index, mid, left_node, node_depth);
+				});
+				build_subtree(mid, right_index, right_node, node_depth);
+				worker.join();
+				build_tasks--;
+			}
+			else {
+				build_subtree(left_index, mid, left_node, node_depth);
+				build_subtree(mid, right_index, right_node, node_depth);
+			}
+		}
+
+		// Makes node an interior node with two new children (stored side by side) of the given bounds
+		void add_children(BVHNode* node, AABB& left_bbox, AABB& right_bbox, BVHNode*& left_node, BVHNode*& right_node) {
+			left_node = new BVHNode();
+			right_node = new BVHNode();
+			left_node->setAABB(left_bbox);
+			right_node->setAABB(right_bbox);
+
+			int index = n_build_nodes.fetch_add(2);
+			nodes[index] = left_node;
+			nodes[index + 1] = right_node;
+			node->makeNode(index);
+		}
+
+		void update_depth(int node_depth) {
+			int d = build_depth;
+			while (node_depth > d && !build_depth.compare_exchange_weak(d, node_depth));
+		}
+
+		// Number of threads that work on a node of n_objs objects
+		int buildChunks(int n_objs) const {
+			return (build_threads > 1 && n_objs >= PARALLEL_BIN_MIN) ? build_threads : 1;
+		}
+
+		// Calls f(chunk, first, last) for n_chunks consecutive ranges of [first, last[, each on its own thread
+		template <class F>
+		static void parallelChunks(int first, int last, int n_chunks, F f) {
+			if (n_chunks <= 1) {
+				f(0, first, last);
+				return;
+			}
+
+			vector<thread> workers;
+			long long size = last - first;
+			for (int c = 1; c < n_chunks; c++) {
+				workers.push_back(thread(f, c, first + (int)(size * c / n_chunks), first + (int)(size * (c + 1) / n_chunks)));
+			}
+			f(0, first, first + (int)(size / n_chunks));
+			for (thread& worker : workers) worker.join();
+		}
+
+		// Bounds of prims [first, last[ split at mid (serial or by chunks of prims)
+		void childBounds(int first, int mid, int last, AABB& left_bbox, AABB& right_bbox) {
+			int n_chunks = buildChunks(last - first);
+			AABB empty = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+			vector<AABB> lefts(n_chunks, empty), rights(n_chunks, empty);
+
+			parallelChunks(first, last, n_chunks, [&](int chunk, int begin, int end) {
+				for (int i = begin; i < end; i++) {
+					if (i < mid) lefts[chunk].extend(prims[i].bbox);
+					else rights[chunk].extend(prims[i].bbox);
+				}
+			});
+
+			left_bbox = right_bbox = empty;
+			for (int c = 0; c < n_chunks; c++) {
+				left_bbox.extend(lefts[c]);
+				right_bbox.extend(rights[c]);
+			}
+		}
+
+		// Binned SAH: the best object split (findObjectSplit) is taken, or a leaf is made when that is cheaper
+		void build_recursive_sah(int left_index, int right_index, BVHNode* node, int node_depth) {
+
+			update_depth(node_depth);
+
+			int n_objs = right_index - left_index;
+
+			if (n_objs == 1 || node_depth == MAX_TREE_DEPTH) {
+				node->makeLeaf(left_index, n_objs);
+				return;
+			}
+
+			ObjectSplit split = findObjectSplit(&prims[left_index], n_objs, node->getAABB().area());
+			float leaf_cost = n_objs * sah_intersection_cost;
+
+			int mid;
+
+			if (split.axis == -1) {
+				// centroids can't be separated
+				if (n_objs <= sah_max_leaf) {
+					node->makeLeaf(left_index, n_objs);
+					return;
+				}
+				mid = left_index + n_objs / 2;
+			}
+			else {
+				if (split.cost >= leaf_cost && n_objs <= sah_max_leaf) {
+					node->makeLeaf(left_index, n_objs);
+					return;
+				}
+
+				// serial, so the order of the prims (and the tree) is the same with any number of threads
+				PrimInfo* first = &prims[0] + left_index;
+				PrimInfo* last = &prims[0] + right_index;
+				mid = partition(first, last, [&](PrimInfo& p) {
+					return getBin(p.centroid.getIndex(split.axis), split.c_min[split.axis], split.extent[split.axis]) < split.bin;
+				}) - &prims[0];
+			}
+
+			AABB left_bbox, right_bbox;
+			childBounds(left_index, mid, right_index, left_bbox, right_bbox);
+
+			BVHNode *left_node, *right_node;
+			add_children(node, left_bbox, right_bbox, left_node, right_node);
+
+			build_children(left_index, mid, left_node, right_index, right_node, node_depth + 1);
+		}
+
+		// Binned SAH over refs[0, n_objs[: the centroids are binned along each axis and the cheapest bin boundary
+		// is chosen. Large nodes are binned by chunks of prims in parallel (min/max and counts, so the bins do not
+		// depend on the chunks)
+		ObjectSplit findObjectSplit(PrimInfo* refs, int n_objs, float node_area) {
+			int n_chunks = buildChunks(n_objs);
+			AABB empty = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+
+			// bounds of the centroids, the bins are laid over them
+			vector<AABB> chunk_bboxes(n_chunks, empty);
+			parallelChunks(0, n_objs, n_chunks, [&](int chunk, int first, int last) {
+				for (int i = first; i < last; i++) {
+					chunk_bboxes[chunk].extend(AABB(refs[i].centroid, refs[i].centroid));
+				}
+			});
+
+			AABB centroid_bbox = empty;
+			for (AABB& box : chunk_bboxes) centroid_bbox.extend(box);
+
+			ObjectSplit split;
+			split.cost = FLT_MAX;
+			split.axis = -1;
+			split.bin = 0;
+			for (int axis = 0; axis < 3; axis++) {
+				split.c_min[axis] = centroid_bbox.min.getIndex(axis);
+				split.extent[axis] = centroid_bbox.max.getIndex(axis) - split.c_min[axis];
+			}
+			const float* c_min = split.c_min;
+			const float* extent = split.extent;
+
+			// bins of the 3 axes of every chunk: bins[(chunk * 3 + axis) * sah_bins + bin]
+			vector<SAHBin> bins(n_chunks * 3 * sah_bins);
+			for (SAHBin& bin : bins) {
+				bin.bbox = empty;
+				bin.count = 0;
+			}
+
+			parallelChunks(0, n_objs, n_chunks, [&](int chunk, int first, int last) {
+				SAHBin* chunk_bins = &bins[chunk * 3 * sah_bins];
+				for (int i = first; i < last; i++) {
+					for (int axis = 0; axis < 3; axis++) {
+						if (extent[axis] <= 0) continue; // all centroids on the same plane
+						SAHBin& bin = chunk_bins[axis * sah_bins + getBin(refs[i].centroid.getIndex(axis), c_min[axis], extent[axis])];
+						bin.count++;
+						bin.bbox.extend(refs[i].bbox);
+					}
+				}
+			});
+
+			for (int c = 1; c < n_chunks; c++) {
+				for (int b = 0; b < 3 * sah_bins; b++) {
+					bins[b].count += bins[c * 3 * sah_bins + b].count;
+					bins[b].bbox.extend(bins[c * 3 * sah_bins + b].bbox);
+				}
+			}
+
+			vector<AABB> right_bbox(sah_bins);
+			vector<int> right_count(sah_bins);
+
+			for (int axis = 0; axis < 3; axis++) {
+				if (extent[axis] <= 0) continue;
+
+				SAHBin* axis_bins = &bins[axis * sah_bins];
+
+				// sweep from the right: bounds and count of everything at the right of each boundary
+				AABB acc = empty;
+				int count = 0;
+				for (int b = sah_bins - 1; b > 0; b--) {
+					acc.extend(axis_bins[b].bbox);
+					count += axis_bins[b].count;
+					right_bbox[b] = acc;
+					right_count[b] = count;
+				}
+
+				// sweep from the left, evaluating the split before bin b
+				acc = empty;
+				count = 0;
+				for (int b = 1; b < sah_bins; b++) {
+					acc.extend(axis_bins[b - 1].bbox);
+					count += axis_bins[b - 1].count;
 
-			int i = 0;
+					if (count == 0 || right_count[b] == 0) continue;
+
+					float cost = sah_traversal_cost +
+						sah_intersection_cost * (acc.area() * count + right_bbox[b].area() * right_count[b]) / node_area;
+
+					if (cost < split.cost) {
+						split.cost = cost;
+						split.axis = axis;
+						split.bin = b;
+						split.left_bbox = acc;
+						split.right_bbox = right_bbox[b];
+					}
+				}
+			}
+			return split;
+		}
+
+		int getBin(float centroid, float c_min, float extent) const {
+			int b = (int)(sah_bins * (centroid - c_min) / extent);
+			return (b < 0) ? 0 : (b >= sah_bins ? sah_bins - 1 : b);
 		}
 
-		void build_recursive(int left_index, int right_index, BVHNode *node) {
+		void build_recursive(int left_index, int right_index, BVHNode *node, int node_depth) {
+
+			update_depth(node_depth);
 
-			if ((right_index - left_index) <= Threshold ) {
+			// the leaf is forced at the maximum depth, so the traversal stack can never overflow
+			if ((right_index - left_index) <= Threshold || node_depth == MAX_TREE_DEPTH) {
 				node->makeLeaf(left_index, (right_index - left_index));
 			}
 			else {
@@ -131,30 +1136,30 @@ class BVH
 				Comparator cmp;
 				cmp.dimension = op;
 
-				sort(objs.begin() + left_index, objs.begin() + right_index, cmp);
+				sort(prims.begin() + left_index, prims.begin() + right_index, cmp);
 
 				float mid_coord = (node_bb.max.getIndex(op) + node_bb.min.getIndex(op)) * 0.5;
 				bool found = false;
 				int i;
 
 				// if no objects are gonna be on the left or right divisions, use mean
-				if (objs[left_index]->getCentroid().getIndex(op) > mid_coord ||
-					objs[right_index - 1]->getCentroid().getIndex(op) <= mid_coord) {
+				if (prims[left_index].centroid.getIndex(op) > mid_coord ||
+					prims[right_index - 1].centroid.getIndex(op) <= mid_coord) {
 					mid_coord = 0;
 					for (i = left_index; i < right_index; i++) {
-						mid_coord += objs[i]->getCentroid().getIndex(op);
+						mid_coord += prims[i].centroid.getIndex(op);
 					}
 					mid_coord /= (right_index - left_index);
 				}
 
-				if (objs[left_index]->getCentroid().getIndex(op) > mid_coord ||
-					objs[right_index - 1]->getCentroid().getIndex(op) <= mid_coord) {
+				if (prims[left_index].centroid.getIndex(op) > mid_coord ||
+					prims[right_index - 1].centroid.getIndex(op) <= mid_coord) {
 
 					i = left_index + Threshold;
 				}
 				else {
 					for (i = left_index; i < right_index; i++) {
-						if (objs[i]->getCentroid().getIndex(op) > mid_coord) {
+						if (prims[i].centroid.getIndex(op) > mid_coord) {
 							break;
 						}
 					}
@@ -162,86 +1167,606 @@ class BVH
 
 				// the i value obtained is the split_index
 
-				Vector min_right, min_left = min_right = Vector(FLT_MAX, FLT_MAX, FLT_MAX);
-				Vector max_right, max_left = max_right = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+				AABB left_bbox, right_bbox;
+				childBounds(left_index, i, right_index, left_bbox, right_bbox);
+
+				BVHNode *left_node, *right_node;
+				add_children(node, left_bbox, right_bbox, left_node, right_node);
+
+				build_children(left_index, i, left_node, right_index, right_node, node_depth + 1);
+			}
+		}
+
+		// Spreads the low 10 (21) bits of x so there are two zero bits after each one
+		static uint64_t spread_bits_10(uint64_t x) {
+			x &= 0x3ff;
+			x = (x | (x << 16)) & 0x030000ff;
+			x = (x | (x << 8)) & 0x0300f00f;
+			x = (x | (x << 4)) & 0x030c30c3;
+			x = (x | (x << 2)) & 0x09249249;
+			return x;
+		}
+
+		static uint64_t spread_bits_21(uint64_t x) {
+			x &= 0x1fffff;
+			x = (x | (x << 32)) & 0x001f00000000ffffULL;
+			x = (x | (x << 16)) & 0x001f0000ff0000ffULL;
+			x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+			x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+			x = (x | (x << 2)) & 0x1249249249249249ULL;
+			return x;
+		}
 
-				AABB left_bbox(min_left, max_left), right_bbox(min_right, max_right);
+		// LBVH: Morton codes of the centroids (quantized in their bounds, 30 bits, or 63 for more than 1M objects),
+		// and the prims sorted by them (LSD radix sort, 8 bits per pass)
+		void sort_morton() {
+			int n = prims.size();
+			int axis_bits = (n > (1 << 20)) ? 21 : 10;
+			int passes = (3 * axis_bits + 7) / 8;
+			float scale = (float)((1 << axis_bits) - 1);
 
-				for (int j = left_index; j < i; j++) {
-					left_bbox.extend(objs[j]->GetBoundingBox());
+			AABB centroid_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+			for (PrimInfo& prim : prims) centroid_bbox.extend(AABB(prim.centroid, prim.centroid));
+
+			float c_min[3], inv_extent[3];
+			for (int axis = 0; axis < 3; axis++) {
+				c_min[axis] = centroid_bbox.min.getIndex(axis);
+				float extent = centroid_bbox.max.getIndex(axis) - c_min[axis];
+				inv_extent[axis] = (extent > 0) ? 1.0f / extent : 0.0f;
+			}
+
+			vector<uint64_t> codes(n), sorted_codes(n);
+			vector<int> order(n), sorted_order(n);
+
+			parallelChunks(0, n, buildChunks(n), [&](int /*chunk*/, int first, int last) {
+				for (int i = first; i < last; i++) {
+					uint64_t q[3];
+					for (int axis = 0; axis < 3; axis++) {
+						q[axis] = (uint64_t)((prims[i].centroid.getIndex(axis) - c_min[axis]) * inv_extent[axis] * scale);
+					}
+					if (axis_bits == 10) codes[i] = spread_bits_10(q[0]) << 2 | spread_bits_10(q[1]) << 1 | spread_bits_10(q[2]);
+					else codes[i] = spread_bits_21(q[0]) << 2 | spread_bits_21(q[1]) << 1 | spread_bits_21(q[2]);
+					order[i] = i;
 				}
+			});
+
+			for (int pass = 0; pass < passes; pass++) {
+				int shift = pass * 8;
+				int offsets[257] = { 0 };
 
-				for (int j = i; j < right_index; j++) {
-					right_bbox.extend(objs[j]->GetBoundingBox());
+				for (int i = 0; i < n; i++) offsets[((codes[i] >> shift) & 0xff) + 1]++;
+				for (int d = 0; d < 256; d++) offsets[d + 1] += offsets[d];
+
+				for (int i = 0; i < n; i++) {
+					int dest = offsets[(codes[i] >> shift) & 0xff]++;
+					sorted_codes[dest] = codes[i];
+					sorted_order[dest] = order[i];
 				}
+				codes.swap(sorted_codes);
+				order.swap(sorted_order);
+			}
 
-				BVHNode* left_node = new BVHNode();
-				BVHNode* right_node = new BVHNode();
-				left_node->setAABB(left_bbox);
+			vector<PrimInfo> sorted_prims(n);
+			for (int i = 0; i < n; i++) sorted_prims[i] = prims[order[i]];
+			prims.swap(sorted_prims);
+			morton.swap(codes);
+		}
+
+		// LBVH: splits at the highest bit where the Morton codes of the range differ (the first half has it at 0),
+		// or in the middle of a run of equal codes. The node bounds are left to refit
+		void build_recursive_lbvh(int left_index, int right_index, BVHNode* node, int node_depth) {
 
-				right_node->setAABB(right_bbox);
+			update_depth(node_depth);
 
-				// before [..., node, ..., x]
-				node->makeNode(nodes.size());
+			int n_objs = right_index - left_index;
+
+			if (n_objs <= Threshold || node_depth == MAX_TREE_DEPTH) {
+				node->makeLeaf(left_index, n_objs);
+				return;
+			}
 
-				// after [..., node, ..., x, left, right] => 
-				// left_index = size of nodes before push_backs
-				// right_index = left_index + 1
-				nodes.push_back(left_node); // [node, ..., left_child_of_node, right_child_of_node, ...]
-				nodes.push_back(right_node);
+			uint64_t first_code = morton[left_index], last_code = morton[right_index - 1];
+			int mid;
+
+			if (first_code == last_code) {
+				mid = left_index + n_objs / 2;
+			}
+			else {
+				int bit = 63;
+				while (!(((first_code ^ last_code) >> bit) & 1)) bit--;
 
-				build_recursive(left_index, i, left_node);
-				build_recursive(i, right_index, right_node);
+				// the codes are sorted: the first code with the bit set starts the right half
+				uint64_t split_code = (last_code >> bit) << bit;
+				mid = lower_bound(morton.begin() + left_index, morton.begin() + right_index, split_code) - morton.begin();
 			}
+
+			AABB empty = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+			BVHNode *left_node, *right_node;
+			add_children(node, empty, empty, left_node, right_node);
+
+			build_children(left_index, mid, left_node, right_index, right_node, node_depth + 1);
 		}
 
-		bool intersect_bvh(Ray ray, Object** hit_obj, Vector &hit_point) {
+		// Bounds of every node from its children (or its objects for a leaf), bottom up
+		AABB refit(BVHNode* node) {
+			AABB bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+
+			if (node->isLeaf()) {
+				for (unsigned int i = node->getIndex(); i < node->getIndex() + node->getNObjs(); i++) bbox.extend(prims[i].bbox);
+			}
+			else {
+				bbox.extend(refit(nodes[node->getIndex()]));
+				bbox.extend(refit(nodes[node->getIndex() + 1]));
+			}
+
+			node->setAABB(bbox);
+			return bbox;
+		}
+
+		// SBVH: builds the tree over the references in prims on this thread, the leaves take the references in order
+		// (so prims ends up with the references of the leaves, duplicates included)
+		void build_sbvh(BVHNode* root, int max_refs) {
+			vector<PrimInfo> refs;
+			refs.swap(prims);
+			prims.reserve(max_refs);
+
+			AABB clipped;
+			for (PrimInfo& ref : refs) ref.clippable = ref.obj->GetClippedBoundingBox(ref.bbox, clipped);
+
+			sbvh_max_refs = max_refs;
+			n_sbvh_refs = refs.size();
+			n_spatial_splits = 0;
+			sbvh_root_area = root->getAABB().area();
+
+			build_recursive_sbvh(refs, root, 1);
+		}
+
+		// SBVH (Stich et al. 2009): the binned SAH object split, or a spatial split (a plane that clips the references
+		// straddling it into both children) when that is cheaper. Spatial splits are only tried where the object split
+		// children overlap (or can't be made) and must fit in the reference budget. Only the objects that can be clipped
+		// (triangles) are split, the others stay whole on the side of their centroid. refs are released before the children
+		void build_recursive_sbvh(vector<PrimInfo>& refs, BVHNode* node, int node_depth) {
+
+			update_depth(node_depth);
+
+			int n_objs = refs.size();
+
+			if (n_objs <= 1 || node_depth == MAX_TREE_DEPTH) {
+				node->makeLeaf(prims.size(), n_objs);
+				prims.insert(prims.end(), refs.begin(), refs.end());
+				return;
+			}
+
+			AABB empty = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+			float node_area = node->getAABB().area();
+			float leaf_cost = n_objs * sah_intersection_cost;
+
+			ObjectSplit object = findObjectSplit(&refs[0], n_objs, node_area);
+
+			SpatialSplit spatial;
+			spatial.cost = FLT_MAX;
+			spatial.axis = -1;
+			if (n_sbvh_refs < sbvh_max_refs) {
+				float overlap = 0;
+				if (object.axis != -1) {
+					AABB both = clipBox(object.left_bbox, object.right_bbox);
+					if (validBox(both)) overlap = both.area();
+				}
+				if (object.axis == -1 || overlap > sbvh_alpha * sbvh_root_area) spatial = findSpatialSplit(refs, node->getAABB(), node_area);
+			}
+
+			bool use_spatial = spatial.cost < object.cost;
+			float best_cost = use_spatial ? spatial.cost : object.cost;
+
+			if (best_cost >= leaf_cost && n_objs <= sah_max_leaf) {
+				node->makeLeaf(prims.size(), n_objs);
+				prims.insert(prims.end(), refs.begin(), refs.end());
+				return;
+			}
+
+			vector<PrimInfo> left, right;
+
+			if (use_spatial) {
+				float plane = spatial.b_min + spatial.extent * spatial.bin / sah_bins;
+				AABB left_bbox = spatial.left_bbox, right_bbox = spatial.right_bbox;
+				int n_left = spatial.n_left, n_right = spatial.n_right;
+
+				for (PrimInfo& ref : refs) {
+					int first_bin, last_bin;
+					spatialBins(ref, spatial.axis, spatial.b_min, spatial.extent, first_bin, last_bin);
+
+					if (last_bin < spatial.bin) left.push_back(ref);
+					else if (first_bin >= spatial.bin) right.push_back(ref);
+					else {
+						// straddles the plane: the whole reference goes to one child if that is cheaper (unsplitting,
+						// the child bounds grow but the other child has one reference less)
+						AABB whole_left = left_bbox, whole_right = right_bbox;
+						whole_left.extend(ref.bbox);
+						whole_right.extend(ref.bbox);
+
+						float split_cost = left_bbox.area() * n_left + right_bbox.area() * n_right;
+						float left_cost = whole_left.area() * n_left + right_bbox.area() * (n_right - 1);
+						float right_cost = left_bbox.area() * (n_left - 1) + whole_right.area() * n_right;
+
+						if (left_cost < split_cost && left_cost <= right_cost) {
+							left.push_back(ref);
+							left_bbox = whole_left;
+							n_right--;
+							continue;
+						}
+						if (right_cost < split_cost) {
+							right.push_back(ref);
+							right_bbox = whole_right;
+							n_left--;
+							continue;
+						}
+
+						// else a reference in each child with the part of the object on its side
+						PrimInfo part = ref;
+						ref.obj->GetClippedBoundingBox(slabBox(ref.bbox, spatial.axis, -FLT_MAX, plane), part.bbox);
+						part.centroid = part.bbox.centroid();
+						if (validBox(part.bbox)) left.push_back(part);
+
+						ref.obj->GetClippedBoundingBox(slabBox(ref.bbox, spatial.axis, plane, FLT_MAX), part.bbox);
+						part.centroid = part.bbox.centroid();
+						if (validBox(part.bbox)) right.push_back(part);
+					}
+				}
+
+				// the clipping left one side empty: back to the object split
+				if (left.empty() || right.empty()) {
+					use_spatial = false;
+					left.clear();
+					right.clear();
+				}
+			}
+
+			if (!use_spatial) {
+				if (object.axis == -1) {
+					// centroids can't be separated
+					left.assign(refs.begin(), refs.begin() + n_objs / 2);
+					right.assign(refs.begin() + n_objs / 2, refs.end());
+				}
+				else {
+					for (PrimInfo& ref : refs) {
+						int bin = getBin(ref.centroid.getIndex(object.axis), object.c_min[object.axis], object.extent[object.axis]);
+						if (bin < object.bin) left.push_back(ref);
+						else right.push_back(ref);
+					}
+				}
+			}
+			else {
+				n_sbvh_refs += left.size() + right.size() - n_objs;
+				n_spatial_splits++;
+			}
+			vector<PrimInfo>().swap(refs);
+
+			AABB left_bbox = empty, right_bbox = empty;
+			for (PrimInfo& ref : left) left_bbox.extend(ref.bbox);
+			for (PrimInfo& ref : right) right_bbox.extend(ref.bbox);
+
+			BVHNode *left_node, *right_node;
+			add_children(node, left_bbox, right_bbox, left_node, right_node);
+
+			build_recursive_sbvh(left, left_node, node_depth + 1);
+			build_recursive_sbvh(right, right_node, node_depth + 1);
+		}
+
+		// Best spatial split of the node: bins laid over the node bounds along each axis, every reference counted
+		// in the bin where it starts and the one where it ends, and its part inside each bin it spans (clipped by
+		// the object) added to that bin. Splits that would overrun the reference budget are skipped
+		SpatialSplit findSpatialSplit(vector<PrimInfo>& refs, AABB& node_bbox, float node_area) {
+			AABB empty = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+			int n_objs = refs.size();
+			int budget = sbvh_max_refs - n_sbvh_refs;
+
+			SpatialSplit split;
+			split.cost = FLT_MAX;
+			split.axis = -1;
+			split.bin = 0;
+			split.b_min = split.extent = 0;
+
+			vector<SpatialBin> bins(sah_bins);
+			vector<AABB> right_bbox(sah_bins);
+			vector<int> right_count(sah_bins);
+
+			for (int axis = 0; axis < 3; axis++) {
+				float b_min = node_bbox.min.getIndex(axis);
+				float extent = node_bbox.max.getIndex(axis) - b_min;
+				if (extent <= 0) continue;
+
+				for (SpatialBin& bin : bins) {
+					bin.bbox = empty;
+					bin.enter = bin.exit = 0;
+				}
+
+				for (PrimInfo& ref : refs) {
+					int first_bin, last_bin;
+					spatialBins(ref, axis, b_min, extent, first_bin, last_bin);
+					bins[first_bin].enter++;
+					bins[last_bin].exit++;
+
+					if (first_bin == last_bin) {
+						bins[first_bin].bbox.extend(ref.bbox);
+						continue;
+					}
+					for (int b = first_bin; b <= last_bin; b++) {
+						float lo = (b == first_bin) ? -FLT_MAX : b_min + extent * b / sah_bins;
+						float hi = (b == last_bin) ? FLT_MAX : b_min + extent * (b + 1) / sah_bins;
+						AABB part;
+						ref.obj->GetClippedBoundingBox(slabBox(ref.bbox, axis, lo, hi), part);
+						if (validBox(part)) bins[b].bbox.extend(part);
+					}
+				}
+
+				// sweep from the right: bounds of everything at the right of each boundary, and the references ending there
+				AABB acc = empty;
+				int count = 0;
+				for (int b = sah_bins - 1; b > 0; b--) {
+					acc.extend(bins[b].bbox);
+					count += bins[b].exit;
+					right_bbox[b] = acc;
+					right_count[b] = count;
+				}
+
+				// sweep from the left (the references starting before the boundary), evaluating the split before bin b
+				acc = empty;
+				count = 0;
+				for (int b = 1; b < sah_bins; b++) {
+					acc.extend(bins[b - 1].bbox);
+					count += bins[b - 1].enter;
+
+					if (count == 0 || right_count[b] == 0) continue;
+					if (count + right_count[b] - n_objs > budget) continue;
+
+					float cost = sah_traversal_cost +
+						sah_intersection_cost * (acc.area() * count + right_bbox[b].area() * right_count[b]) / node_area;
+
+					if (cost < split.cost) {
+						split.cost = cost;
+						split.axis = axis;
+						split.bin = b;
+						split.b_min = b_min;
+						split.extent = extent;
+						split.left_bbox = acc;
+						split.right_bbox = right_bbox[b];
+						split.n_left = count;
+						split.n_right = right_count[b];
+					}
+				}
+			}
+			return split;
+		}
+
+		// Spatial bins where a reference starts and ends. One that can't be clipped is only in the bin of its centroid
+		void spatialBins(PrimInfo& ref, int axis, float b_min, float extent, int& first_bin, int& last_bin) const {
+			if (!ref.clippable) {
+				first_bin = last_bin = getBin(ref.centroid.getIndex(axis), b_min, extent);
+				return;
+			}
+			first_bin = getBin(ref.bbox.min.getIndex(axis), b_min, extent);
+			last_bin = getBin(ref.bbox.max.getIndex(axis), b_min, extent);
+		}
+
+		// box with its extent along axis limited to [lo, hi]
+		static AABB slabBox(AABB box, int axis, float lo, float hi) {
+			float b_min[3] = { box.min.x, box.min.y, box.min.z }, b_max[3] = { box.max.x, box.max.y, box.max.z };
+			b_min[axis] = MAX(b_min[axis], lo);
+			b_max[axis] = MIN(b_max[axis], hi);
+			return AABB(Vector(b_min[0], b_min[1], b_min[2]), Vector(b_max[0], b_max[1], b_max[2]));
+		}
+
+		static AABB clipBox(const AABB& a, const AABB& b) {
+			return AABB(Vector(MAX(a.min.x, b.min.x), MAX(a.min.y, b.min.y), MAX(a.min.z, b.min.z)),
+				Vector(MIN(a.max.x, b.max.x), MIN(a.max.y, b.max.y), MIN(a.max.z, b.max.z)));
+		}
+
+		static bool validBox(const AABB& box) {
+			return box.min.x <= box.max.x && box.min.y <= box.max.y && box.min.z <= box.max.z;
+		}
+
+		// Largest packet accepted by intersect_packet
+		static const int MAX_PACKET = 64;
+
+		// Closest hits of a packet of coherent rays (e.g. the primary rays of one pixel). Every node is visited once
+		// for the whole packet: an interval test over all the rays culls the node for the packet at once, otherwise
+		// the rays are tested in order until one hits it, and the rays before that one are inactive in the subtree.
+		// Always uses the binary tree (flat_nodes), whatever the width used for single rays
+		void intersect_packet(Ray* rays, int n, HitRecordSet hits) const {
+			float tmin[MAX_PACKET];
+			float inv_dir[MAX_PACKET][3];
+
+			for (int k = 0; k < n; k++) {
+				tmin[k] = FLT_MAX;
+				hits.objs[k] = NULL;
+				inv_dir[k][0] = 1.0f / rays[k].direction.x;
+				inv_dir[k][1] = 1.0f / rays[k].direction.y;
+				inv_dir[k][2] = 1.0f / rays[k].direction.z;
+			}
+
+			if (n_flat_nodes == 0) return;
+
+			// bounds of the origins and inverse directions of the packet, for the interval test
+			float o_lo[3], o_hi[3], i_lo[3], i_hi[3];
+			bool use_interval = true;
+
+			for (int axis = 0; axis < 3; axis++) {
+				o_lo[axis] = i_lo[axis] = FLT_MAX;
+				o_hi[axis] = i_hi[axis] = -FLT_MAX;
+
+				for (int k = 0; k < n; k++) {
+					float o = rays[k].origin.getIndex(axis);
+					o_lo[axis] = MIN(o_lo[axis], o);
+					o_hi[axis] = MAX(o_hi[axis], o);
+					i_lo[axis] = MIN(i_lo[axis], inv_dir[k][axis]);
+					i_hi[axis] = MAX(i_hi[axis], inv_dir[k][axis]);
+				}
+
+				// only valid when the whole packet goes the same way along the axis
+				if (!(i_lo[axis] > 0 || i_hi[axis] < 0) || !isfinite(i_lo[axis]) || !isfinite(i_hi[axis])) use_interval = false;
+			}
+
+			uint64_t visits = 0;
+			PacketStackItem stack[MAX_TREE_DEPTH];
+			int stack_size = 0;
+
+			int current = 0, first = 0;
+
+			while (true) {
+				visits++;
+				const LinearBVHNode& node = flat_nodes[current];
+				bool visit = !use_interval || intersect_node_interval(node, o_lo, o_hi, i_lo, i_hi);
+
+				// first ray that hits the node before its closest hit
+				float t;
+				while (visit && first < n) {
+					if (intersect_node(node, rays[first].origin, inv_dir[first], t) && t < tmin[first]) break;
+					first++;
+				}
+
+				if (visit && first < n) {
+					if (!(node.count & LEAF_FLAG)) {
+						int l_node = current + 1;
+						int r_node = node.offset;
+						float l_t, r_t;
+
+						// visit first the child the first active ray reaches first
+						if (!intersect_node(flat_nodes[l_node], rays[first].origin, inv_dir[first], l_t)) l_t = FLT_MAX;
+						if (!intersect_node(flat_nodes[r_node], rays[first].origin, inv_dir[first], r_t)) r_t = FLT_MAX;
+
+						if (l_t <= r_t) {
+							stack[stack_size++] = { r_node, first };
+							current = l_node;
+						}
+						else {
+							stack[stack_size++] = { l_node, first };
+							current = r_node;
+						}
+						continue;
+					}
+
+					unsigned int last = node.offset + (node.count & ~LEAF_FLAG);
+					for (int k = first; k < n; k++) {
+						float curr_t;
+						for (unsigned int i = node.offset; i < last; i++) {
+							if (objs[i]->intercepts(rays[k], curr_t) && curr_t < tmin[k]) {
+								tmin[k] = curr_t;
+								hits.objs[k] = objs[i];
+							}
+						}
+					}
+				}
+
+				if (stack_size == 0) break;
+
+				stack_size--;
+				current = stack[stack_size].node;
+				first = stack[stack_size].first;
+			}
+
+			STAT(BvhNodes, visits);
+
+			for (int k = 0; k < n; k++) {
+				hits.t[k] = tmin[k];
+				if (hits.objs[k] != NULL) hits.points[k] = rays[k].direction * tmin[k] + rays[k].origin;
+			}
+		}
+
+		// Conservative slab test of a node against all the rays of a packet (interval arithmetic over the packet
+		// origins and inverse directions). False only if no ray of the packet can hit the node
+		static bool intersect_node_interval(const LinearBVHNode& node, const float* o_lo, const float* o_hi, const float* i_lo, const float* i_hi) {
+			float t0 = 0, t1 = FLT_MAX;
+
+			for (int axis = 0; axis < 3; axis++) {
+				bool positive = i_lo[axis] > 0;
+				float near_plane = positive ? node.bmin[axis] : node.bmax[axis];
+				float far_plane = positive ? node.bmax[axis] : node.bmin[axis];
+
+				// smallest possible entry and largest possible exit along the axis
+				float d_near = positive ? near_plane - o_hi[axis] : near_plane - o_lo[axis];
+				float d_far = positive ? far_plane - o_lo[axis] : far_plane - o_hi[axis];
+				float t_near = MIN(d_near * i_lo[axis], d_near * i_hi[axis]);
+				float t_far = MAX(d_far * i_lo[axis], d_far * i_hi[axis]);
+
+				t0 = MAX(t0, t_near);
+				t1 = MIN(t1, t_far);
+			}
+
+			return t0 <= t1 && t1 > 0.0001;
+		}
+
+		// Closest hit. Traversal state lives on the caller's stack, so one BVH can be queried by several threads at once
+		bool intersect_bvh(Ray ray, Object** hit_obj, Vector &hit_point) const {
+			if (n_flat_nodes == 0) return false;
+			if (width == 4) return intersect_wide<4>(wide4, ray, hit_obj, hit_point);
+			if (width == 8) return intersect_wide<8>(wide8, ray, hit_obj, hit_point);
+			return intersect_binary(ray, hit_obj, hit_point);
+		}
+
+		// Any hit (shadow feelers), re-entrant as intersect_bvh
+		bool bool_intersect_bvh(Ray ray) const {
+			if (n_flat_nodes == 0) return false;
+			if (width == 4) return bool_intersect_wide<4>(wide4, ray);
+			if (width == 8) return bool_intersect_wide<8>(wide8, ray);
+			return bool_intersect_binary(ray);
+		}
+
+		bool intersect_binary(Ray& ray, Object** hit_obj, Vector &hit_point) const {
 			float tmp, tmin = FLT_MAX;
 			bool hit = false;
+			uint64_t visits = 0;
+
+			StackItem hit_stack[MAX_TREE_DEPTH];
+			int stack_size = 0;
 
-			BVHNode* currentNode = nodes[0];
-			if (!currentNode->getAABB().intercepts(ray, tmp)) {
+			float inv_dir[3] = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+
+			if (n_flat_nodes == 0 || !intersect_node(flat_nodes[0], ray.origin, inv_dir, tmp)) {
 				return false;
 			}
 
+			int current = 0;
+
 			while (true) {
-				if (!currentNode->isLeaf()) {
-					BVHNode* l_node = nodes[currentNode->getIndex()];
-					BVHNode* r_node = nodes[currentNode->getIndex() + 1];
-					float l_t, r_t;
+				visits++;
+				const LinearBVHNode& node = flat_nodes[current];
 
-					bool l_hit = l_node->getAABB().intercepts(ray, l_t);
-					bool r_hit = r_node->getAABB().intercepts(ray, r_t);
+				if (!(node.count & LEAF_FLAG)) {
+					int l_node = current + 1;
+					int r_node = node.offset;
+					float l_t, r_t;
 
-					if (l_node->getAABB().isInside(ray.origin)) l_t = 0;
-					if (r_node->getAABB().isInside(ray.origin)) r_t = 0;
+					// children farther than the closest hit so far can be skipped
+					bool l_hit = intersect_node(flat_nodes[l_node], ray.origin, inv_dir, l_t) && l_t < tmin;
+					bool r_hit = intersect_node(flat_nodes[r_node], ray.origin, inv_dir, r_t) && r_t < tmin;
 
 					if (l_hit && r_hit) {
 						if (l_t < r_t) {
-							currentNode = l_node;
-							// push l to stack
-							hit_stack.push(StackItem(r_node, r_t));
+							current = l_node;
+							// push r to stack
+							hit_stack[stack_size++] = { r_node, r_t };
 						}
 						else {
-							currentNode = r_node;
+							current = r_node;
 							// push l to stack
-							hit_stack.push(StackItem(l_node, l_t));
+							hit_stack[stack_size++] = { l_node, l_t };
 						}
 						continue;
 					}
 					else if (l_hit) {
-						currentNode = l_node;
+						current = l_node;
 						continue;
 					}
 					else if (r_hit) {
-						currentNode = r_node;
+						current = r_node;
 						continue;
 					}
 				}
 				else {
 					Object* obj;
 					float curr_t;
-					for (int i = currentNode->getIndex(); i < currentNode->getIndex() + currentNode->getNObjs(); i++) {
+					unsigned int last = node.offset + (node.count & ~LEAF_FLAG);
+					for (unsigned int i = node.offset; i < last; i++) {
 						obj = objs[i];
 						if (obj->intercepts(ray, curr_t) && curr_t < tmin) {
 							tmin = curr_t;
@@ -253,12 +1778,12 @@ class BVH
 
 				bool changed = false;
 
-				while (!hit_stack.empty()) {
-					StackItem popped = hit_stack.top();
-					hit_stack.pop();
+				// pop until a node that may still hold a closer hit
+				while (stack_size > 0) {
+					StackItem popped = hit_stack[--stack_size];
 
 					if (popped.t < tmin) {
-						currentNode = popped.ptr;
+						current = popped.node;
 						changed = true;
 						break;
 					}
@@ -266,76 +1791,81 @@ class BVH
 
 				if (changed) continue;
 
-				if (hit_stack.empty()) {
-					if (hit) {
-						hit_point = ray.direction * tmin + ray.origin;
-					}
-					return hit;
+				STAT(BvhNodes, visits);
+
+				if (hit) {
+					hit_point = ray.direction * tmin + ray.origin;
 				}
+				return hit;
 			}
 		}
 
-		bool bool_intersect_bvh(Ray ray) {
+		bool bool_intersect_binary(Ray& ray) const {
 			float tmp;
-			BVHNode* currentNode = nodes[0];
-			if (!currentNode->getAABB().intercepts(ray, tmp)) {
+			uint64_t visits = 0;
+
+			int hit_stack[MAX_TREE_DEPTH];
+			int stack_size = 0;
+
+			float inv_dir[3] = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+
+			if (n_flat_nodes == 0 || !intersect_node(flat_nodes[0], ray.origin, inv_dir, tmp)) {
 				return false;
 			}
 
+			int current = 0;
+
 			while (true) {
-				if (!currentNode->isLeaf()) {
-					BVHNode* l_node = nodes[currentNode->getIndex()];
-					BVHNode* r_node = nodes[currentNode->getIndex() + 1];
+				visits++;
+				const LinearBVHNode& node = flat_nodes[current];
+
+				if (!(node.count & LEAF_FLAG)) {
+					int l_node = current + 1;
+					int r_node = node.offset;
 					float l_t, r_t;
 
-					bool l_hit = l_node->getAABB().intercepts(ray, l_t);
-					bool r_hit = r_node->getAABB().intercepts(ray, r_t);
+					bool l_hit = intersect_node(flat_nodes[l_node], ray.origin, inv_dir, l_t);
+					bool r_hit = intersect_node(flat_nodes[r_node], ray.origin, inv_dir, r_t);
 
 					if (l_hit && r_hit) {
 						if (l_t < r_t) {
-							currentNode = l_node;
-							// push l to stack
-							hit_stack.push(StackItem(r_node, r_t));
+							current = l_node;
+							hit_stack[stack_size++] = r_node;
 						}
 						else {
-							currentNode = r_node;
-							// push l to stack
-							hit_stack.push(StackItem(l_node, l_t));
+							current = r_node;
+							hit_stack[stack_size++] = l_node;
 						}
 						continue;
 					}
 					else if (l_hit) {
-						currentNode = l_node;
+						current = l_node;
 						continue;
 					}
 					else if (r_hit) {
-						currentNode = r_node;
+						current = r_node;
 						continue;
 					}
 				}
 				else {
 					Object* obj;
 					float curr_t;
-					for (int i = currentNode->getIndex(); i < currentNode->getIndex() + currentNode->getNObjs(); i++) {
+					unsigned int last = node.offset + (node.count & ~LEAF_FLAG);
+					for (unsigned int i = node.offset; i < last; i++) {
 						obj = objs[i];
 						if (obj->intercepts(ray, curr_t)) {
+							STAT(BvhNodes, visits);
 							return true;
 						}
 					}
 				}
 
-				bool changed = false;
-
-				while (!hit_stack.empty()) {
-					StackItem popped = hit_stack.top();
-					hit_stack.pop();
-					currentNode = popped.ptr;
-					changed = true;
+				if (stack_size == 0) {
+					STAT(BvhNodes, visits);
+					return false;
 				}
 
-				if (changed) continue;
-
-				if (hit_stack.empty()) { return false; }
+				current = hit_stack[--stack_size];
 			}
 		}		
 };
\ No newline at end of file
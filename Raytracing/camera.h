@@ -113,6 +113,13 @@ public:
 
 		return Ray(eye_offset, ray_dir);
 	}
+
+	Ray PrimaryRay(const Vector& pixel_sample, Sampler& sampler) // DOF: lens sample taken uniformly on the unit disk
+	{
+		float u, v;
+		sampler.get2D(u, v);
+		return PrimaryRay(sample_unit_disk(u, v), pixel_sample);
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "checkpoint.h"
+
+// file layout: magic, version, header fields, accum
+static const char CHECKPOINT_MAGIC[4] = { 'R', 'T', 'C', 'K' };
+static const uint32_t CHECKPOINT_VERSION = 2;
+
+static void hashBytes(uint64_t& hash, const unsigned char* bytes, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+}
+
+uint64_t hashFile(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) return 0;
+
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned char buffer[4096];
+	size_t n;
+
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) hashBytes(hash, buffer, n);
+
+	fclose(file);
+	return hash;
+}
+
+uint64_t hashString(const string& text)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	hashBytes(hash, (const unsigned char*)text.data(), text.size());
+	return hash;
+}
+
+bool saveCheckpoint(const char* filename, const Checkpoint& checkpoint)
+{
+	string tmp = string(filename) + ".tmp";
+	FILE* file = fopen(tmp.c_str(), "wb");
+	if (file == NULL) return false;
+
+	int32_t sampler = (int32_t)checkpoint.sampler;
+	uint32_t n_pixels = (uint32_t)checkpoint.accum.size() / 3;
+
+	bool ok = fwrite(CHECKPOINT_MAGIC, 4, 1, file) == 1
+		&& fwrite(&CHECKPOINT_VERSION, sizeof(CHECKPOINT_VERSION), 1, file) == 1
+		&& fwrite(&checkpoint.scene_hash, sizeof(checkpoint.scene_hash), 1, file) == 1
+		&& fwrite(&checkpoint.config_hash, sizeof(checkpoint.config_hash), 1, file) == 1
+		&& fwrite(&checkpoint.res_x, sizeof(checkpoint.res_x), 1, file) == 1
+		&& fwrite(&checkpoint.res_y, sizeof(checkpoint.res_y), 1, file) == 1
+		&& fwrite(&sampler, sizeof(sampler), 1, file) == 1
+		&& fwrite(&checkpoint.target_samples, sizeof(checkpoint.target_samples), 1, file) == 1
+		&& fwrite(&checkpoint.frame, sizeof(checkpoint.frame), 1, file) == 1
+		&& fwrite(&checkpoint.samples, sizeof(checkpoint.samples), 1, file) == 1
+		&& fwrite(&n_pixels, sizeof(n_pixels), 1, file) == 1
+		&& fwrite(checkpoint.accum.data(), sizeof(float), 3 * n_pixels, file) == 3 * n_pixels;
+
+	ok = (fclose(file) == 0) && ok;
+	if (!ok) {
+		remove(tmp.c_str());
+		return false;
+	}
+
+	// rename doesn't replace an existing file on Windows
+	remove(filename);
+	return rename(tmp.c_str(), filename) == 0;
+}
+
+bool loadCheckpoint(const char* filename, Checkpoint& checkpoint)
+{
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) return false;
+
+	char magic[4];
+	uint32_t version, n_pixels;
+	int32_t sampler;
+
+	bool ok = fread(magic, 4, 1, file) == 1 && memcmp(magic, CHECKPOINT_MAGIC, 4) == 0
+		&& fread(&version, sizeof(version), 1, file) == 1 && version == CHECKPOINT_VERSION
+		&& fread(&checkpoint.scene_hash, sizeof(checkpoint.scene_hash), 1, file) == 1
+		&& fread(&checkpoint.config_hash, sizeof(checkpoint.config_hash), 1, file) == 1
+		&& fread(&checkpoint.res_x, sizeof(checkpoint.res_x), 1, file) == 1
+		&& fread(&checkpoint.res_y, sizeof(checkpoint.res_y), 1, file) == 1
+		&& fread(&sampler, sizeof(sampler), 1, file) == 1
+		&& fread(&checkpoint.target_samples, sizeof(checkpoint.target_samples), 1, file) == 1
+		&& fread(&checkpoint.frame, sizeof(checkpoint.frame), 1, file) == 1
+		&& fread(&checkpoint.samples, sizeof(checkpoint.samples), 1, file) == 1 && checkpoint.samples >= 0
+		&& fread(&n_pixels, sizeof(n_pixels), 1, file) == 1
+		&& n_pixels == (uint32_t)checkpoint.res_x * checkpoint.res_y;
+
+	if (ok) {
+		checkpoint.sampler = (sampler_type)sampler;
+		checkpoint.accum.resize(3 * n_pixels);
+		ok = fread(checkpoint.accum.data(), sizeof(float), 3 * n_pixels, file) == 3 * n_pixels;
+	}
+
+	fclose(file);
+	return ok;
+}
+
+CheckpointWriter::CheckpointWriter(const char* filename)
+	: filename(filename), has_pending(false), busy(false), quit(false)
+{
+	writer = thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		quit = true;
+	}
+	cv.notify_all();
+	writer.join();
+}
+
+bool CheckpointWriter::submit(Checkpoint& checkpoint, bool wait)
+{
+	unique_lock<mutex> guard(lock);
+
+	if (has_pending || busy) {
+		if (!wait) return false;
+		cv.wait(guard, [this]() { return !has_pending && !busy; });
+	}
+
+	swap(pending, checkpoint);
+	has_pending = true;
+	guard.unlock();
+	cv.notify_all();
+	return true;
+}
+
+void CheckpointWriter::run(void)
+{
+	unique_lock<mutex> guard(lock);
+
+	while (true) {
+		cv.wait(guard, [this]() { return has_pending || quit; });
+		if (!has_pending) break;	// quit with nothing left to write
+
+		Checkpoint checkpoint;
+		swap(checkpoint, pending);
+		has_pending = false;
+		busy = true;
+
+		guard.unlock();
+		if (!saveCheckpoint(filename.c_str(), checkpoint)) printf("\nError saving the checkpoint %s\n", filename.c_str());
+		guard.lock();
+
+		busy = false;
+		cv.notify_all();
+	}
+}
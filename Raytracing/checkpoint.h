@@ -0,0 +1,60 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+#include "sampler.h"
+
+using namespace std;
+
+// State of a progressive render: enough to continue it where it stopped.
+// The random numbers of a sample only depend on (pixel, sample index, frame) and the sampler, so the next
+// sample index of every pixel is the whole RNG state
+struct Checkpoint {
+	uint64_t scene_hash;	// hash of the scene file, a checkpoint only resumes the scene it was taken from
+	uint64_t config_hash;	// hash of the render options that change the radiance of a sample (describeEstimator)
+	int res_x, res_y;
+	sampler_type sampler;
+	int target_samples;		// samples per pixel the sampler sequences were built for
+	unsigned int frame;
+	int samples;			// samples taken by every pixel (the passes take the same from all) = next sample index
+	vector<float> accum;	// linear rgb sums of those samples
+};
+
+// FNV-1a hash of the contents of a file (0 if it can't be read)
+uint64_t hashFile(const char* filename);
+// FNV-1a hash of a string
+uint64_t hashString(const string& text);
+
+// The file is written to filename.tmp and then renamed, so a crash while writing keeps the previous checkpoint
+bool saveCheckpoint(const char* filename, const Checkpoint& checkpoint);
+bool loadCheckpoint(const char* filename, Checkpoint& checkpoint);
+
+// Writes checkpoints on a thread of its own, so the render never waits for the disk
+class CheckpointWriter
+{
+public:
+	CheckpointWriter(const char* filename);
+	~CheckpointWriter();	// finishes the pending write
+
+	// Hands a checkpoint over to the writer thread (taking its buffers). If the previous one is still
+	// being written the new one is dropped (returns false), unless wait is set
+	bool submit(Checkpoint& checkpoint, bool wait = false);
+
+private:
+	string filename;
+	Checkpoint pending;
+	bool has_pending, busy, quit;
+	mutex lock;
+	condition_variable cv;
+	thread writer;
+
+	void run(void);
+};
+
+#endif
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+static bool parseBool(const string& value, bool& flag)
+{
+	if (value == "1" || value == "on" || value == "true") flag = true;
+	else if (value == "0" || value == "off" || value == "false") flag = false;
+	else return false;
+	return true;
+}
+
+static bool parseDouble(const string& value, double min, double& number)
+{
+	char* end;
+	double n = strtod(value.c_str(), &end);
+	if (value.empty() || *end != '\0' || !(n >= min)) return false;
+	number = n;
+	return true;
+}
+
+static bool parseInt(const string& value, int min, int& number)
+{
+	char* end;
+	long n = strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0' || n < min) return false;
+	number = (int)n;
+	return true;
+}
+
+bool setOption(RenderConfig& config, const string& name, const string& value)
+{
+	bool ok;
+
+	if (name == "pathtracing") ok = parseBool(value, config.pathtracing);
+	else if (name == "antialiasing") ok = parseBool(value, config.antialiasing);
+	else if (name == "dof") ok = parseBool(value, config.depth_of_field);
+	else if (name == "soft-shadows") ok = parseBool(value, config.soft_shadows);
+	else if (name == "skybox") ok = parseBool(value, config.skybox);
+	else if (name == "accel-cache") ok = parseBool(value, config.accel_cache);
+	else if (name == "progressive") ok = parseBool(value, config.progressive);
+	else if (name == "adaptive") ok = parseBool(value, config.adaptive);
+	else if (name == "wavefront") ok = parseBool(value, config.wavefront);
+	else if (name == "time-budget") ok = parseDouble(value, 0.0, config.time_budget);
+	else if (name == "adaptive-threshold") ok = parseDouble(value, 0.0, config.adaptive_threshold);
+	else if (name == "spp") ok = parseInt(value, 1, config.spp);
+	else if (name == "max-depth") ok = parseInt(value, 0, config.max_depth);
+	else if (name == "adaptive-min-spp") ok = parseInt(value, 1, config.adaptive_min_spp);
+	else if (name == "grid-levels") ok = parseInt(value, 1, config.grid_levels);
+	else if (name == "bvh-width") {
+		int width = 0;
+		ok = parseInt(value, 2, width) && (width == 2 || width == 4 || width == 8);
+		if (ok) config.bvh_width = width;
+	}
+	else if (name == "accel") {
+		ok = true;
+		if (value == "none") config.accel = accel_struct::None;
+		else if (value == "grid") config.accel = accel_struct::UGrid;
+		else if (value == "bvh") config.accel = accel_struct::Bvh;
+		else ok = false;
+	}
+	else if (name == "sampler") {
+		ok = true;
+		if (value == "random") config.sampler = sampler_type::Random;
+		else if (value == "stratified") config.sampler = sampler_type::Stratified;
+		else if (value == "halton") config.sampler = sampler_type::Halton;
+		else if (value == "sobol") config.sampler = sampler_type::Sobol;
+		else if (value == "bluenoise") config.sampler = sampler_type::BlueNoise;
+		else ok = false;
+	}
+	else if (name == "bvh-builder") {
+		ok = true;
+		if (value == "midpoint") config.builder = bvh_builder::Midpoint;
+		else if (value == "sah") config.builder = bvh_builder::Sah;
+		else if (value == "lbvh") config.builder = bvh_builder::Lbvh;
+		else if (value == "sbvh") config.builder = bvh_builder::Sbvh;
+		else ok = false;
+	}
+	else if (name == "grid-layout") {
+		ok = true;
+		if (value == "vectors") config.grid_cells = grid_layout::CellVectors;
+		else if (value == "csr") config.grid_cells = grid_layout::Csr;
+		else ok = false;
+	}
+	else {
+		printf("Unknown option %s\n", name.c_str());
+		return false;
+	}
+
+	if (!ok) printf("Invalid value '%s' for option %s\n", value.c_str(), name.c_str());
+	return ok;
+}
+
+string describeConfig(const RenderConfig& config)
+{
+	char line[256];
+	snprintf(line, sizeof(line), "%s, antialiasing %s, dof %s, soft shadows %s, skybox %s, spp %d, max depth %d, "
+		"accel %s, sampler %s, bvh %s/%d, grid %s/%d, accel cache %s%s%s%s",
+		config.pathtracing ? "path tracing" : "ray tracing", config.antialiasing ? "on" : "off",
+		config.depth_of_field ? "on" : "off", config.soft_shadows ? "on" : "off", config.skybox ? "on" : "off",
+		config.spp, config.max_depth, accelName(config.accel), Sampler::name(config.sampler),
+		builderName(config.builder), config.bvh_width,
+		config.grid_cells == grid_layout::Csr ? "csr" : "vectors", config.grid_levels, config.accel_cache ? "on" : "off",
+		config.progressive ? ", progressive" : "", config.adaptive ? ", adaptive" : "", config.wavefront ? ", wavefront" : "");
+	if (config.progressive && config.time_budget > 0) {
+		snprintf(line + strlen(line), sizeof(line) - strlen(line), " (time budget %.1f s)", config.time_budget);
+	}
+	if (config.adaptive) {
+		snprintf(line + strlen(line), sizeof(line) - strlen(line), " (min spp %d, threshold %g)",
+			config.adaptive_min_spp, config.adaptive_threshold);
+	}
+	return line;
+}
+
+string describeEstimator(const RenderConfig& config)
+{
+	char line[256];
+	snprintf(line, sizeof(line), "%s, antialiasing %s, dof %s, soft shadows %s, skybox %s, max depth %d, sampler %s",
+		config.pathtracing ? "path tracing" : "ray tracing", config.antialiasing ? "on" : "off",
+		config.depth_of_field ? "on" : "off", config.soft_shadows ? "on" : "off", config.skybox ? "on" : "off",
+		config.max_depth, Sampler::name(config.sampler));
+	return line;
+}
+
+const char* accelName(accel_struct accel)
+{
+	const char* names[] = { "none", "grid", "bvh" };
+	return names[accel];
+}
+
+const char* builderName(bvh_builder builder)
+{
+	const char* names[] = { "midpoint", "sah", "lbvh", "sbvh" };
+	return names[builder];
+}
@@ -0,0 +1,59 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+
+#include "sampler.h"
+
+using namespace std;
+
+enum accel_struct {None, UGrid, Bvh};
+
+// BVH construction algorithms: split at the midpoint (or mean) of the largest axis, binned Surface Area Heuristic,
+// linear BVH (objects sorted by the Morton code of their centroid: fastest build, slower traversal), or SAH with
+// spatial splits (objects that straddle a split plane are referenced by both children: fewer overlapping nodes)
+enum bvh_builder {Midpoint, Sah, Lbvh, Sbvh};
+
+// Storage of the uniform grid cells: a vector of objects per cell, or all the cells in one array (compressed
+// sparse rows: the objects of each cell are a range of it)
+enum grid_layout {CellVectors, Csr};
+
+// Render options chosen at run time, from "opt <name> <value>" lines of the scene file and then -<name> <value>
+// on the command line (which wins). The feature flags select one of the specialized render kernels per render
+struct RenderConfig {
+	bool pathtracing = true;		// path tracing instead of ray tracing (not reccomended without antialiasing)
+	bool antialiasing = true;		// multiple samples per pixel (also turns on the DOF)
+	bool depth_of_field = true;		// needs antialiasing
+	bool soft_shadows = false;		// area lights (without antialiasing every light is replicated spp times)
+	bool skybox = true;				// background of the rays that miss: skybox (if the scene has one) or background color
+	int spp = 400;					// samples per pixel
+	int max_depth = 20;				// number of bounces of secondary rays
+	accel_struct accel = accel_struct::Bvh;
+	sampler_type sampler = sampler_type::Sobol;	// samples of the pixels, lens, lights and BSDFs
+	bvh_builder builder = bvh_builder::Sah;
+	int bvh_width = 4;				// children per BVH node: 2, 4 or 8 (wide BVHs test all the children with SIMD)
+	grid_layout grid_cells = grid_layout::Csr;
+	int grid_levels = 3;			// 1 -> uniform grid, else the overfull cells get subgrids, down to this many levels
+	bool accel_cache = true;		// BVH: load it from (or save it to) scene file.bvhcache instead of building it every run
+	bool progressive = false;		// passes over the whole image up to spp samples per pixel, with checkpoints (needs antialiasing)
+	double time_budget = 0;			// progressive: seconds after which no more passes start (0 -> no time limit)
+	bool adaptive = false;			// adaptive sampling: every pixel takes samples until it converges, spp at most
+	int adaptive_min_spp = 16;		// adaptive: samples every pixel takes before its error is checked
+	double adaptive_threshold = 0.02;	// adaptive: converged once the standard error of the mean luminance is this fraction of it
+	bool wavefront = false;			// path tracing by the wavefront (queue based) integrator instead of the recursive Radiance
+};
+
+// Sets the option name (pathtracing, antialiasing, dof, soft-shadows, skybox, spp, max-depth, accel, sampler,
+// bvh-builder, bvh-width, grid-layout, grid-levels, accel-cache, progressive, time-budget, adaptive, adaptive-min-spp,
+// adaptive-threshold, wavefront) from its text value. false (and the config unchanged) if the option or value is unknown
+bool setOption(RenderConfig& config, const string& name, const string& value);
+
+// One line summary of the config
+string describeConfig(const RenderConfig& config);
+// Summary of the options that change the radiance of a sample (not the accelerators, nor how many samples are taken)
+string describeEstimator(const RenderConfig& config);
+
+const char* accelName(accel_struct accel);
+const char* builderName(bvh_builder builder);
+
+#endif
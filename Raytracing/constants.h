@@ -2,14 +2,9 @@
 #define __CONSTANTS_H__
 
 #pragma once
-//Number of bounces of secondary rays
-#define MAX_DEPTH 20
 
-//Shadow type (true -> Soft Shadows, false->hard shadows)
-#define SOFT_SHADOWS false
-
-//Sample per Pixel (in truth this is the sqrt spp) [also number of rays to shoot in no antialiasing soft shadows]
-#define SPP 20
+//The render features (path tracing, antialiasing, DOF, soft shadows, skybox), spp and max depth are run time
+//options, see RenderConfig (config.h)
 
 //size of the side of the light jitter
 #define LIGHT_SIDE .5f
@@ -17,31 +12,64 @@
 //Hard colors for intersections test
 #define TEST_INTERSECT false
 
-//Sample unit disk? (false for normal jitter)
+//Sample unit disk? (false -> square lens)
 #define SAMPLE_DISK true
 
-//Antialiasing flag (also turns on the DOF)
-#define ANTIALIASING true
-
-//Depth of field flag (for DOF to work, antialiasing must be true as well)
-#define DEPTH_OF_FIELD true
-
-//background color (true -> skybox; false -> background_color)
-#define SKYBOX true
-
 //test depth of intersections
 #define DEPTH_MAP false
 
-// use path tracing instead of ray tracing (not reccomended without antialiasing)
-#define PATHTRACING true
+//camera paths traced together by the wavefront integrator (wavefront option)
+#define WAVE_SIZE 16384
 
 #define GAMMA 1.0f
 
+//adaptive sampling (adaptive, adaptive-min-spp and adaptive-threshold options, spp is the cap): the error of pixels
+//darker than ADAPTIVE_DARK_LUMINANCE is relative to this luminance instead of their mean, so black pixels converge
+#define ADAPTIVE_DARK_LUMINANCE 0.1f
+
+//adaptive sampling debug: also save the samples taken by every pixel (RT_Samples.png, white -> spp)
+#define SAMPLE_COUNT_AOV false
+
+//traversal cost debug: also save the BVH nodes visited, grid cells stepped and primitive tests of every pixel, as a
+//false colour heatmap of their sum (RT_Cost.png) and as floats (RT_Cost.pfm, r: nodes, g: cells, b: tests).
+//Needs RENDER_STATS (stats.h), the wavefront integrator is not used
+#define COST_AOV false
+
+//progressive rendering (progressive option, needs antialiasing): passes of PASS_SAMPLES samples per pixel over the
+//whole image are added to a float accumulation buffer and the window is updated after every pass. Stops at spp
+//samples per pixel or once time-budget seconds have passed
+#define PASS_SAMPLES 4
+
+//progressive rendering: seconds between checkpoints of the accumulation buffer (0 -> no checkpoints), -resume continues
+//the render from the last checkpoint
+#define CHECKPOINT_INTERVAL 60.0
+#define CHECKPOINT_FILE "RT_Checkpoint.bin"
+
+//trace the primary rays of a pixel in packets through the BVH (Bvh only, needs antialiasing)
+#define PACKET_TRACING true
+
+//number of rays in a packet (at most BVH::MAX_PACKET)
+#define PACKET_SIZE 16
+
+//size of the side of the tiles handed to the render threads
+#define TILE_SIZE 16
+
+//Binned SAH BVH builder: number of bins, cost of a node traversal, cost of a primitive test, max objects in a leaf
+#define SAH_BINS 12
+#define SAH_TRAVERSAL_COST 1.0f
+#define SAH_INTERSECTION_COST 1.0f
+#define SAH_MAX_LEAF 8
+
+//Spatial split BVH builder (bvh-builder sbvh): spatial splits are tried in the nodes whose best object split has
+//children overlapping by more than SBVH_ALPHA of the root surface area, and they may add at most
+//SBVH_MAX_DUPLICATION references per object (memory budget of the duplicated references)
+#define SBVH_ALPHA 1e-5f
+#define SBVH_MAX_DUPLICATION 1.0f
 
-enum accel_struct {None, UGrid, Bvh};
-enum sample_mode {jitter, tent};
+//Hierarchical grid (grid-levels > 1): cells with more objects than this get a subgrid of their own
+#define GRID_MAX_CELL_OBJECTS 16
 
-accel_struct acl_str = accel_struct::Bvh;
-sample_mode s_mode = sample_mode::jitter;
+//Benchmark (-bench): samples per pixel of every run, instead of the scene's (-spp overrides it)
+#define BENCH_SPP 4
 
 #endif // __CONSTANTS_H__
\ No newline at end of file
@@ -1,74 +1,233 @@
+#include <stdio.h>
+#include <chrono>
+
 #include "grid.h"
+#include "stats.h"
 
 void Grid::Build()
 {
+	auto timeStart = chrono::high_resolution_clock::now();
 
 	// Find the grid bounds
 	Vector p0 = find_min_bounds();
 	Vector p1 = find_max_bounds();
 
-	bbox = AABB(p0, p1);
+	build(AABB(p0, p1));
 
-	Vector w = p1 - p0; //grid dim
+	auto timeEnd = chrono::high_resolution_clock::now();
+	double build_ms = chrono::duration<double, milli>(timeEnd - timeStart).count();
 
-	int num_obj = getNumObjects();
-	float s = powf(num_obj / (w.x * w.y * w.z), 1 / 3);
+	int n_subgrids = 0;
+	size_t n_cells = 0, refs = 0;
+	countCells(n_subgrids, n_cells, refs);
 
-	// Number of cells in each coordinate
-	nx = trunc(m * w.x * s) + 1;
-	ny = trunc(m * w.y * s) + 1;
-	nz = trunc(m * w.z * s) + 1;
+	printf("Grid (%s): %d objects, %d x %d x %d cells, %d subgrids, %zu cells in all, %zu references, build %.2f ms, %.1f MB\n",
+		layout == grid_layout::Csr ? "csr" : "cell vectors", getNumObjects(), nx, ny, nz, n_subgrids, n_cells, refs,
+		build_ms, memoryBytes() / (1024.0 * 1024.0));
+}
+
+// Sets up the cells over bounds (a subgrid covers a cell of its parent, its objects may stick out of it), then the
+// subgrids of the overfull cells
+void Grid::build(const AABB& bounds)
+{
+	bbox = bounds;
+
+	Vector w = bbox.max - bbox.min; //grid dim
+
+	int num_obj = getNumObjects();
+	float s = powf(num_obj / (w.x * w.y * w.z), 1.0f / 3);	// cells per unit of length (1 / 3 was 0 -> s = 1)
+
+	// Number of cells in each coordinate. A flat box (e.g. the cell of a terrain) would get many more cells
+	// than the m**3 per object, so it gets fewer cells per unit of length
+	float max_cells = 2 * m * m * m * MAX(num_obj, 1);
+	do {
+		nx = trunc(m * w.x * s) + 1;
+		ny = trunc(m * w.y * s) + 1;
+		nz = trunc(m * w.z * s) + 1;
+		s *= 0.9f;
+	} while ((float)nx * ny * nz > max_cells);
 
 	int cell_num = nx * ny * nz; // = m**3 * num_obj
 
-	// Init cell vector
 	// Cells stored as 1D array of length Nx * Ny * Nz
 	// Array index of cell(ix, iy, iz) is index = ix + Nx * iy + Nx * Ny * iz
+	cells = vector<vector<Object*> >();
+	cell_offsets = vector<unsigned int>();
+	cell_objects = vector<Object*>();
+	subgrids = vector<Grid>();
+	cell_subgrid = vector<int>();
+
+	int lo[3], hi[3];
+
+	if (layout == grid_layout::CellVectors) {
+		cells.resize(cell_num);
+
+		// insert obj to the overlaped cells
+		for (int j = 0; j < num_obj; j++) {
+			Object* obj = getObject(j);
+			cellRange(obj->GetBoundingBox(), lo, hi);
+
+			for (int iz = lo[2]; iz <= hi[2]; iz++)
+				for (int iy = lo[1]; iy <= hi[1]; iy++)
+					for (int ix = lo[0]; ix <= hi[0]; ix++)
+						cells[ix + nx * iy + nx * ny * iz].push_back(obj);
+		}
+	}
+	else {
+		// first pass: objects per cell (in cell_offsets[c + 1]), turned into the start of every cell
+		vector<AABB> obj_bboxes(num_obj);
+		cell_offsets.assign(cell_num + 1, 0);
+
+		for (int j = 0; j < num_obj; j++) {
+			obj_bboxes[j] = getObject(j)->GetBoundingBox();
+			cellRange(obj_bboxes[j], lo, hi);
+
+			for (int iz = lo[2]; iz <= hi[2]; iz++)
+				for (int iy = lo[1]; iy <= hi[1]; iy++)
+					for (int ix = lo[0]; ix <= hi[0]; ix++)
+						cell_offsets[ix + nx * iy + nx * ny * iz + 1]++;
+		}
+
+		for (int c = 0; c < cell_num; c++) cell_offsets[c + 1] += cell_offsets[c];
+
+		// second pass: every object into its cells, in the object order (like the cell vectors)
+		vector<unsigned int> next(cell_offsets.begin(), cell_offsets.end() - 1);
+		cell_objects.resize(cell_offsets[cell_num]);
+
+		for (int j = 0; j < num_obj; j++) {
+			cellRange(obj_bboxes[j], lo, hi);
+
+			for (int iz = lo[2]; iz <= hi[2]; iz++)
+				for (int iy = lo[1]; iy <= hi[1]; iy++)
+					for (int ix = lo[0]; ix <= hi[0]; ix++)
+						cell_objects[next[ix + nx * iy + nx * ny * iz]++] = getObject(j);
+		}
+	}
+
+	if (levels > 1) buildSubgrids();
+}
+
+// Every cell with more than max_cell_objects objects gets a grid of its own (one level less) over the part of the
+// cell its objects take, unless that does not split them: objects larger than the cell are in all its subcells
+void Grid::buildSubgrids()
+{
+	int cell_num = nx * ny * nz;
+	Vector cell_size = Vector((bbox.max.x - bbox.min.x) / nx, (bbox.max.y - bbox.min.y) / ny, (bbox.max.z - bbox.min.z) / nz);
+	Object* const* first, * const* last;
+
+	for (int iz = 0; iz < nz; iz++)
+		for (int iy = 0; iy < ny; iy++)
+			for (int ix = 0; ix < nx; ix++) {
+				int index = ix + nx * iy + nx * ny * iz;
+				getCell(index, first, last);
+				int count = last - first;
+				if (count <= max_cell_objects) continue;
+
+				Grid sub;
+				sub.setLayout(layout);
+				sub.setLevels(levels - 1, max_cell_objects);
+				sub.objects.assign(first, last);
+
+				// the cell, clipped to the bounds of its objects
+				Vector p0 = sub.find_min_bounds(), p1 = sub.find_max_bounds();
+				Vector c0 = Vector(bbox.min.x + ix * cell_size.x, bbox.min.y + iy * cell_size.y, bbox.min.z + iz * cell_size.z);
+				Vector c1 = c0 + cell_size;
+				p0 = Vector(MAX(p0.x, c0.x), MAX(p0.y, c0.y), MAX(p0.z, c0.z));
+				p1 = Vector(MIN(p1.x, c1.x), MIN(p1.y, c1.y), MIN(p1.z, c1.z));
+				sub.build(AABB(p0, p1));
+
+				// useless if its average cell still holds half of the objects
+				int sub_subgrids = 0;
+				size_t sub_cells = 0, sub_refs = 0;
+				sub.countCells(sub_subgrids, sub_cells, sub_refs);
+				if (sub_cells == 1 || 2 * sub_refs >= (size_t)count * sub_cells) continue;
+
+				sub.objects = vector<Object*>();	// the subgrid is only traversed
+				if (cell_subgrid.empty()) cell_subgrid.assign(cell_num, -1);
+				cell_subgrid[index] = subgrids.size();
+				subgrids.push_back(sub);
+				if (layout == grid_layout::CellVectors) cells[index] = vector<Object*>();
+			}
+
+	if (subgrids.empty() || layout == grid_layout::CellVectors) return;
+
+	// the objects of the cells with a subgrid are dropped from the cell array
+	vector<Object*> kept;
+	kept.reserve(cell_objects.size());
 	for (int c = 0; c < cell_num; c++) {
-		cells.push_back(vector<Object*>());
+		unsigned int begin = cell_offsets[c], end = cell_offsets[c + 1];
+		cell_offsets[c] = kept.size();
+		if (cell_subgrid[c] < 0) kept.insert(kept.end(), cell_objects.begin() + begin, cell_objects.begin() + end);
 	}
+	cell_offsets[cell_num] = kept.size();
+	kept.shrink_to_fit();
+	cell_objects.swap(kept);
+}
 
-	AABB obj_bbox; Object* obj;
-	for (int j = 0; j < num_obj; j++) {
-		obj = getObject(j);
-		obj_bbox = obj->GetBoundingBox();
-
-		// Compute indices of both cells that contain min and max coord of obj bbox
-		int ixmin = clamp(
-			(obj_bbox.min.x - p0.x) * nx / (p1.x - p0.x),
-			0, nx - 1);
-		int iymin = clamp(
-			(obj_bbox.min.y - p0.y) * ny / (p1.y - p0.y),
-			0, ny - 1);
-		int izmin = clamp(
-			(obj_bbox.min.z - p0.z) * nz / (p1.z - p0.z),
-			0, nz - 1);
-
-		int ixmax = clamp(
-			(obj_bbox.max.x - p0.x) * nx / (p1.x - p0.x),
-			0, nx - 1);
-		int iymax = clamp(
-			(obj_bbox.max.y - p0.y) * ny / (p1.y - p0.y),
-			0, ny - 1);
-		int izmax = clamp(
-			(obj_bbox.max.z - p0.z) * nz / (p1.z - p0.z),
-			0, nz - 1);
-
-		int index;
-
-	// insert obj to the overlaped cells
-		for (int iz = izmin; iz <= izmax; iz++)
-			for (int iy = iymin; iy <= iymax; iy++)
-				for (int ix = ixmin; ix <= ixmax; ix++) {
-					index = ix + nx * iy + nx * ny * iz;
-					cells.at(index).push_back(obj);
-				}
+// Subgrids, cells and object references of this grid and all its subgrids
+void Grid::countCells(int& n_subgrids, size_t& n_cells, size_t& refs) const
+{
+	n_subgrids += subgrids.size();
+	n_cells += (size_t)nx * ny * nz;
+	refs += cell_objects.size();
+	for (const vector<Object*>& cell : cells) refs += cell.size();
+	for (const Grid& sub : subgrids) sub.countCells(n_subgrids, n_cells, refs);
+}
+
+void Grid::cellRange(const AABB& box, int* lo, int* hi) const
+{
+	// Compute indices of both cells that contain min and max coord of obj bbox
+	lo[0] = clamp((box.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
+	lo[1] = clamp((box.min.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
+	lo[2] = clamp((box.min.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+
+	hi[0] = clamp((box.max.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
+	hi[1] = clamp((box.max.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
+	hi[2] = clamp((box.max.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+}
+
+inline void Grid::getCell(int index, Object* const*& first, Object* const*& last) const
+{
+	if (layout == grid_layout::Csr) {
+		first = cell_objects.data() + cell_offsets[index];
+		last = cell_objects.data() + cell_offsets[index + 1];
+	}
+	else {
+		first = cells[index].data();
+		last = first + cells[index].size();
 	}
+}
+
+// Heap storage of the cells and subgrids (the allocator overhead of every cell vector not included)
+size_t Grid::memoryBytes(void) const
+{
+	size_t bytes = cells.capacity() * sizeof(vector<Object*>);
+	for (const vector<Object*>& cell : cells) bytes += cell.capacity() * sizeof(Object*);
 
+	bytes += cell_offsets.capacity() * sizeof(unsigned int) + cell_objects.capacity() * sizeof(Object*);
+
+	bytes += cell_subgrid.capacity() * sizeof(int) + subgrids.capacity() * sizeof(Grid);
+	for (const Grid& sub : subgrids) bytes += sub.memoryBytes();
+	return bytes;
 }
 
 //Traverse throught the grid find object the was hit 
 bool Grid::Traverse(Ray& ray, Object** hitobject, Vector& hitpoint)
+{
+	Object* obj;
+	float t;
+
+	if (!closestHit(ray, obj, t)) {
+		return false;
+	}
+
+	*hitobject = obj;
+	hitpoint = ray.origin + ray.direction * t;
+	return true;
+}
+
+// Closest object hit by the ray and its distance. The cells with a subgrid are traversed by it
+bool Grid::closestHit(Ray& ray, Object*& hit_obj, float& hit_t)
 {
 	//starting cell indices
 	int ix, iy, iz;
@@ -82,8 +241,8 @@ bool Grid::Traverse(Ray& ray, Object** hitobject, Vector& hitpoint)
 		return false;
 	}
 	
-	vector<Object*> cell;
-	Object* obj, *min_obj;
+	Object* const* first, * const* last;
+	Object* min_obj;
 
 	min_obj = NULL;
 	min_t = FLT_MAX;
@@ -91,23 +250,31 @@ bool Grid::Traverse(Ray& ray, Object** hitobject, Vector& hitpoint)
 
 	while (true) {
 
-		cell = cells.at(ix + nx * iy + nx * ny * iz);
+		int index = ix + nx * iy + nx * ny * iz;
+		getCell(index, first, last);
+		STAT(GridCells, 1);
 
-		for (int i = 0; i < cell.size(); i++) {
-			obj = cell.at(i);
+		if (!cell_subgrid.empty() && cell_subgrid[index] >= 0) {
+			Object* sub_obj;
+			if (subgrids[cell_subgrid[index]].closestHit(ray, sub_obj, t) && t < min_t) {
+				min_t = t;
+				min_obj = sub_obj;
+			}
+		}
 
-			if (obj->intercepts(ray, t)) {
+		for (Object* const* obj = first; obj != last; obj++) {
+			if ((*obj)->intercepts(ray, t)) {
 				if (t < min_t) {
 					min_t = t;
-					min_obj = obj;
+					min_obj = *obj;
 				}
 			}
 		}
 		
 		if (tx_next < ty_next && tx_next < tz_next) {
 			if (min_obj != NULL && min_t < tx_next) {
-				*hitobject = min_obj;
-				hitpoint = ray.origin + ray.direction * min_t;
+				hit_obj = min_obj;
+				hit_t = min_t;
 				return true;
 			}
 
@@ -121,8 +288,8 @@ bool Grid::Traverse(Ray& ray, Object** hitobject, Vector& hitpoint)
 		}
 		else if (ty_next < tz_next) {
 			if (min_obj != NULL && min_t < ty_next) {
-				*hitobject = min_obj;
-				hitpoint = ray.origin + ray.direction * min_t;
+				hit_obj = min_obj;
+				hit_t = min_t;
 				return true;
 			}
 
@@ -135,8 +302,8 @@ bool Grid::Traverse(Ray& ray, Object** hitobject, Vector& hitpoint)
 		}
 		else {
 			if (min_obj != NULL && min_t < tz_next) {
-				*hitobject = min_obj;
-				hitpoint = ray.origin + ray.direction * min_t;
+				hit_obj = min_obj;
+				hit_t = min_t;
 				return true;
 			}
 
@@ -165,16 +332,19 @@ bool Grid::Traverse(Ray& ray)
 		return false; // If not inside box
 	}
 
-	vector<Object*> cell;
-	Object* obj, * min_obj;
+	Object* const* first, * const* last;
 
 	while (true) {
-		cell = cells.at(ix + nx * iy + nx * ny * iz);
+		int index = ix + nx * iy + nx * ny * iz;
+		getCell(index, first, last);
+		STAT(GridCells, 1);
 
-		for (int i = 0; i < cell.size(); i++) {
-			obj = cell.at(i);
+		if (!cell_subgrid.empty() && cell_subgrid[index] >= 0 && subgrids[cell_subgrid[index]].Traverse(ray)) {
+			return true;
+		}
 
-			if (obj->intercepts(ray, t)) {
+		for (Object* const* obj = first; obj != last; obj++) {
+			if ((*obj)->intercepts(ray, t)) {
 				return true;
 			}
 		}
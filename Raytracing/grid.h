@@ -7,6 +7,7 @@
 #include "vector.h"
 #include "boundingBox.h"
 #include "maths.h"
+#include "config.h"
 
 using namespace std;
 
@@ -20,14 +21,32 @@ public:
 	void addObject(Object* o);
 	Object* getObject(unsigned int index);
 
+	void setLayout(grid_layout layout_) { layout = layout_; }
+
+	// levels = 1 -> uniform grid, else the cells with more than max_cell_objects objects get a subgrid (with
+	// levels - 1 levels)
+	void setLevels(int levels_, int max_cell_objects_) { levels = levels_; max_cell_objects = max_cell_objects_; }
+
 	void Build(void);   // set up grid cells
 
+	size_t memoryBytes(void) const;	// storage of the cells
+
 	bool Traverse(Ray& ray, Object **hitobject, Vector& hitpoint);  //(const Ray& ray, double& tmin, ShadeRec& sr)
 	bool Traverse(Ray& ray);  //Traverse for shadow ray
 
 private:
 	vector<Object *> objects;
-	vector<vector<Object*> > cells;
+
+	grid_layout layout = grid_layout::Csr;
+	vector<vector<Object*> > cells;		// CellVectors: the objects of every cell
+	// Csr: the objects of cell c are cell_objects[cell_offsets[c]] .. cell_objects[cell_offsets[c + 1] - 1]
+	vector<unsigned int> cell_offsets;
+	vector<Object*> cell_objects;
+
+	int levels = 1;
+	int max_cell_objects = 16;
+	vector<Grid> subgrids;
+	vector<int> cell_subgrid;	// subgrid of every cell (-1 -> none), empty if the grid has no subgrids
 
 	int nx, ny, nz; // number of cells in the x, y, and z directions
 	float m = 2.0f; // factor that allows to vary the number of cells
@@ -35,6 +54,18 @@ private:
 	Vector find_min_bounds(void);
 	Vector find_max_bounds(void);
 
+	void build(const AABB& bounds);
+	void buildSubgrids(void);
+	void countCells(int& n_subgrids, size_t& n_cells, size_t& refs) const;
+
+	bool closestHit(Ray& ray, Object*& hit_obj, float& hit_t);
+
+	// Cells overlapped by a bounding box: [lo, hi] in each axis
+	void cellRange(const AABB& box, int* lo, int* hi) const;
+
+	// Objects of a cell, in place: [first, last[
+	void getCell(int index, Object* const*& first, Object* const*& last) const;
+
 	//Setup function for Grid traversal
 	bool Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, double& tx_next, double& ty_next, double& tz_next, 
 		int& ix_step, int& iy_step, int& iz_step, int& ix_stop, int& iy_stop, int& iz_stop);
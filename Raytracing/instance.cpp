@@ -0,0 +1,213 @@
+#include <float.h>
+
+#include "instance.h"
+#include "constants.h"
+#include "bvh.cpp"
+
+// ======== TRANSFORM METHODS ========
+
+Transform::Transform()
+{
+	for (int i = 0; i < 12; i++) m[i] = inv[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+}
+
+bool Transform::set(const float matrix[12])
+{
+	const float* a = matrix;
+
+	// cofactors of the linear part
+	float c00 = a[5] * a[10] - a[6] * a[9], c01 = a[6] * a[8] - a[4] * a[10], c02 = a[4] * a[9] - a[5] * a[8];
+	float c10 = a[2] * a[9] - a[1] * a[10], c11 = a[0] * a[10] - a[2] * a[8], c12 = a[1] * a[8] - a[0] * a[9];
+	float c20 = a[1] * a[6] - a[2] * a[5], c21 = a[2] * a[4] - a[0] * a[6], c22 = a[0] * a[5] - a[1] * a[4];
+
+	float det = a[0] * c00 + a[1] * c01 + a[2] * c02;
+	if (fabs(det) < 1e-12f) return false;
+	float inv_det = 1.0f / det;
+
+	for (int i = 0; i < 12; i++) m[i] = a[i];
+
+	float linear[9] = { c00, c10, c20, c01, c11, c21, c02, c12, c22 };
+	for (int row = 0; row < 3; row++) {
+		for (int col = 0; col < 3; col++) inv[row * 4 + col] = linear[row * 3 + col] * inv_det;
+		inv[row * 4 + 3] = -(inv[row * 4] * a[3] + inv[row * 4 + 1] * a[7] + inv[row * 4 + 2] * a[11]);
+	}
+	return true;
+}
+
+Vector Transform::toWorld(const Vector& p) const
+{
+	return Vector(m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3],
+		m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7],
+		m[8] * p.x + m[9] * p.y + m[10] * p.z + m[11]);
+}
+
+Vector Transform::dirToWorld(const Vector& d) const
+{
+	return Vector(m[0] * d.x + m[1] * d.y + m[2] * d.z,
+		m[4] * d.x + m[5] * d.y + m[6] * d.z,
+		m[8] * d.x + m[9] * d.y + m[10] * d.z);
+}
+
+Vector Transform::normalToWorld(const Vector& n) const
+{
+	return Vector(inv[0] * n.x + inv[4] * n.y + inv[8] * n.z,
+		inv[1] * n.x + inv[5] * n.y + inv[9] * n.z,
+		inv[2] * n.x + inv[6] * n.y + inv[10] * n.z);
+}
+
+Vector Transform::toLocal(const Vector& p) const
+{
+	return Vector(inv[0] * p.x + inv[1] * p.y + inv[2] * p.z + inv[3],
+		inv[4] * p.x + inv[5] * p.y + inv[6] * p.z + inv[7],
+		inv[8] * p.x + inv[9] * p.y + inv[10] * p.z + inv[11]);
+}
+
+Vector Transform::dirToLocal(const Vector& d) const
+{
+	return Vector(inv[0] * d.x + inv[1] * d.y + inv[2] * d.z,
+		inv[4] * d.x + inv[5] * d.y + inv[6] * d.z,
+		inv[8] * d.x + inv[9] * d.y + inv[10] * d.z);
+}
+
+// Every row: the translation plus the smaller (larger) of each term over the box
+AABB Transform::boundsToWorld(const AABB& box) const
+{
+	float lo[3] = { box.min.x, box.min.y, box.min.z }, hi[3] = { box.max.x, box.max.y, box.max.z };
+	float out_lo[3], out_hi[3];
+
+	for (int row = 0; row < 3; row++) {
+		out_lo[row] = out_hi[row] = m[row * 4 + 3];
+		for (int col = 0; col < 3; col++) {
+			float a = m[row * 4 + col] * lo[col], b = m[row * 4 + col] * hi[col];
+			out_lo[row] += MIN(a, b);
+			out_hi[row] += MAX(a, b);
+		}
+	}
+	return AABB(Vector(out_lo[0], out_lo[1], out_lo[2]), Vector(out_hi[0], out_hi[1], out_hi[2]));
+}
+
+// ======== PROTOTYPE METHODS ========
+
+Prototype::~Prototype()
+{
+	delete bvh;	// not the objects: like the scene's, they have no virtual destructor
+}
+
+AABB Prototype::getBounds()
+{
+	AABB bounds = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (Object* obj : objects) bounds.extend(obj->GetBoundingBox());
+	return bounds;
+}
+
+void Prototype::build(bvh_builder builder, int width, int threads)
+{
+	if (bvh != NULL && built_builder == builder && built_width == width) return;
+
+	delete bvh;
+	bvh = new BVH();
+	bvh->setBuilder(builder);
+	bvh->setWidth(width);
+	bvh->setBuildThreads(threads);
+	bvh->setSAHParams(SAH_BINS, SAH_TRAVERSAL_COST, SAH_INTERSECTION_COST, SAH_MAX_LEAF);
+	bvh->setSpatialSplits(SBVH_ALPHA, SBVH_MAX_DUPLICATION);
+
+	printf("Prototype %s: ", name.c_str());
+	bvh->build(objects);
+
+	built_builder = builder;
+	built_width = width;
+}
+
+bool Prototype::intersect(const Ray& ray, Object** hit_obj, Vector& hit_point) const
+{
+	return bvh->intersect_bvh(ray, hit_obj, hit_point);
+}
+
+size_t Prototype::memoryBytes() const
+{
+	return (bvh != NULL) ? bvh->memoryBytes() : 0;
+}
+
+// ======== INSTANCE METHODS ========
+
+// Instances have no material of their own (their hits are shaded with the material of the object hit). Not
+// emissive, so the light lists skip them
+static Material instance_material;
+
+// USE_MAIL: ids of the rays in prototype space, above the ids of the world rays
+static uint64_t local_ray_id = 1ULL << 62;
+
+Instance::Instance(Prototype* prototype_, const Transform& transform_)
+	: prototype(prototype_)
+{
+	SetMaterial(&instance_material);
+	setTransform(transform_);
+}
+
+void Instance::setTransform(const Transform& transform_)
+{
+	transform = transform_;
+	bounds = transform.boundsToWorld(prototype->getBounds());
+}
+
+bool Instance::intercepts(Ray& r, float& t)
+{
+	if (USE_MAIL) {
+		if (mailbox >= r.id) return false;
+		mailbox = r.id;
+	}
+	STAT(InstanceTests, 1);
+
+	Object* hit_obj;
+	return intersect(r, t, &hit_obj);
+}
+
+bool Instance::intersect(Ray& r, float& t, Object** hit_obj)
+{
+	// the ray in prototype space with a unit direction (the spheres expect one): distances along it are
+	// scale times those along the world ray
+	Vector dir = transform.dirToLocal(r.direction);
+	float scale = dir.length();
+	if (scale <= 0) return false;
+
+	Ray local = Ray(transform.toLocal(r.origin), dir / scale, r.i, r.j);
+
+	// the objects of a prototype are shared by all its instances, so their mailboxes need ids of their own
+	local.id = USE_MAIL ? ++local_ray_id : r.id;
+
+	Vector hit_point;
+	if (!prototype->intersect(local, hit_obj, hit_point)) return false;
+
+	t = ((hit_point - local.origin) * local.direction) / scale;
+	return true;
+}
+
+Vector Instance::getNormal(Vector point)
+{
+	Vector normal = point - bounds.centroid();
+	return normal.normalize();
+}
+
+// ======== INSTANCEHIT METHODS ========
+
+Object* InstanceHit::resolve(Object* hit, Ray& ray)
+{
+	if (hit == NULL || !hit->isInstance()) return hit;
+
+	float t;
+	instance = (Instance*)hit;
+	if (!instance->intersect(ray, t, &obj)) obj = NULL;	// only if rounding makes the ray miss it this time
+
+	SetMaterial(obj != NULL ? obj->GetMaterial() : instance->GetMaterial());
+	return this;
+}
+
+Vector InstanceHit::getNormal(Vector point)
+{
+	if (obj == NULL) return instance->getNormal(point);
+
+	const Transform& transform = instance->getTransform();
+	Vector normal = transform.normalToWorld(obj->getNormal(transform.toLocal(point)));
+	return normal.normalize();
+}
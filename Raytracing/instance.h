@@ -0,0 +1,117 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <string>
+#include <vector>
+
+#include "scene.h"
+#include "config.h"
+
+using namespace std;
+
+class BVH;
+
+// Affine transform from prototype space to world space: a 3x4 matrix (rows, the translation in the last
+// column), kept with its inverse
+class Transform
+{
+public:
+	Transform();	// identity
+
+	// false (and the transform unchanged) if the matrix is singular
+	bool set(const float matrix[12]);
+	const float* getMatrix() const { return m; }
+
+	Vector toWorld(const Vector& p) const;
+	Vector dirToWorld(const Vector& d) const;
+	Vector normalToWorld(const Vector& n) const;	// by the inverse transpose, not normalized
+	Vector toLocal(const Vector& p) const;
+	Vector dirToLocal(const Vector& d) const;
+
+	AABB boundsToWorld(const AABB& box) const;	// world bounds of a prototype space box
+
+private:
+	float m[12];
+	float inv[12];
+};
+
+// Geometry defined once in the scene file ("proto" block) and placed any number of times by instances. Its
+// objects stay in prototype space, with one BVH over them (the bottom level) shared by all the instances
+class Prototype
+{
+public:
+	Prototype(const string& name_) : name(name_) {}
+	Prototype(const Prototype&) = delete;
+	Prototype& operator=(const Prototype&) = delete;
+	~Prototype();
+
+	const string& getName() const { return name; }
+	void addObject(Object* obj) { objects.push_back(obj); }
+	int getNumObjects() const { return objects.size(); }
+
+	AABB getBounds();	// of the objects, in prototype space
+
+	// Builds the BVH over the objects, unless it is already built with these settings
+	void build(bvh_builder builder, int width, int threads);
+
+	// Closest hit of a prototype space ray (re-entrant)
+	bool intersect(const Ray& ray, Object** hit_obj, Vector& hit_point) const;
+
+	size_t memoryBytes() const;
+
+private:
+	string name;
+	vector<Object*> objects;
+	BVH* bvh = NULL;
+	bvh_builder built_builder = bvh_builder::Sah;
+	int built_width = 0;	// 0 -> not built
+};
+
+// A prototype placed in the scene by a transform: an object of the top level (the accel structure of the scene),
+// whose rays are moved into prototype space and traced through the prototype's BVH
+class Instance : public Object
+{
+public:
+	Instance(Prototype* prototype_, const Transform& transform_);
+
+	bool intercepts(Ray& r, float& t);
+	// closest hit, also the object of the prototype that was hit
+	bool intersect(Ray& r, float& t, Object** hit_obj);
+
+	// Hits are shaded as the object hit inside (InstanceHit): this is only the fallback, the normal of the bounds
+	Vector getNormal(Vector point);
+	AABB GetBoundingBox(void) { return bounds; }
+	Vector getCentroid(void) { return bounds.centroid(); }
+	bool isInstance(void) { return true; }
+
+	// Moves the instance: only the top level has to be rebuilt, the prototype's BVH doesn't change
+	void setTransform(const Transform& transform_);
+	const Transform& getTransform() const { return transform; }
+	Prototype* getPrototype() { return prototype; }
+
+private:
+	Prototype* prototype;
+	Transform transform;
+	AABB bounds;	// world space
+};
+
+// The object of a prototype hit through an instance, in world space: what the shading asks the hit object for
+// (normal and material). Must outlive the shading of the hit
+class InstanceHit : public Object
+{
+public:
+	// The object to shade for the closest hit obj of ray: obj itself, or (for an instance) the object of its
+	// prototype that the ray hits, found by tracing the ray through that one instance again
+	Object* resolve(Object* obj, Ray& ray);
+
+	Vector getNormal(Vector point);
+	bool intercepts(Ray& r, float& t) { return instance->intercepts(r, t); }
+	AABB GetBoundingBox(void) { return instance->GetBoundingBox(); }
+	Vector getCentroid(void) { return instance->getCentroid(); }
+
+private:
+	Instance* instance = NULL;
+	Object* obj = NULL;
+};
+
+#endif
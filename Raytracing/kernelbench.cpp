@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <float.h>
+#include <chrono>
+#include <vector>
+
+#include "kernelbench.h"
+#include "scene.h"
+#include "bvh.cpp"
+#include "rng.h"
+#include "stats.h"
+
+// Rays and primitives of every batch. Both fit in the L1/L2 caches, so the timings are of the kernels and not of
+// the memory. In pass p ray r is tested against primitive (r + p) % BENCH_PRIMS: every pair is different.
+// Powers of two, so the indexing is a mask and not a division (as slow as the cheapest kernels)
+static const int BENCH_RAYS = 4096;
+static const int BENCH_PRIMS = 4096;
+
+// The fastest of this many runs of every kernel
+static const int BENCH_RUNS = 3;
+
+static volatile float benchSink;	// keeps the distances alive, so the compiler cannot drop the kernels
+
+struct KernelResult {
+	double ns;		// per test
+	double hit_rate;
+};
+
+static int bitCount(int mask)
+{
+	int n = 0;
+	for (; mask; mask &= mask - 1) n++;
+	return n;
+}
+
+static Vector randomPoint(RNG& rng, float extent)
+{
+	return Vector(rng.nextFloat() * 2 - 1, rng.nextFloat() * 2 - 1, rng.nextFloat() * 2 - 1) * extent;
+}
+
+static Vector randomDirection(RNG& rng)
+{
+	float z = 1 - 2 * rng.nextFloat();
+	float r = sqrt(MAX(0.0f, 1 - z * z));
+	float phi = 2 * PI * rng.nextFloat();
+	return Vector(r * cos(phi), r * sin(phi), z);
+}
+
+// Runs test(ray, primitive, t) over n_tests pairs (n_prims must be a power of two), BENCH_RUNS times. A wide test checks "width" boxes at once and
+// returns its hit mask: the time and hit rate are per box, over n_tests boxes
+template <class Test>
+static KernelResult timeKernel(int n_tests, int n_prims, int width, Test test)
+{
+	KernelResult result = { 1e30, 0 };
+	int n_calls = n_tests / width;
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		uint64_t hits = 0;
+		float t_sum = 0;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int k = 0; k < n_calls; k++) {
+			int r = k & (BENCH_RAYS - 1);
+			int p = (r + k / BENCH_RAYS) & (n_prims - 1);
+			float t = 0;
+			int mask = test(r, p, t);
+			hits += bitCount(mask);
+			t_sum += t;
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+
+		benchSink = t_sum;
+		double ns = std::chrono::duration<double, std::nano>(end - start).count() / ((double)n_calls * width);
+		result.ns = MIN(result.ns, ns);
+		result.hit_rate = (double)hits / ((double)n_calls * width);
+	}
+	return result;
+}
+
+static void printResult(const char* kernel, const KernelResult& result)
+{
+	printf("%-34s %9.2f %8.1f%%\n", kernel, result.ns, 100 * result.hit_rate);
+	fflush(stdout);
+}
+
+int kernelBenchmark(int n_tests)
+{
+	RNG rng(2024);
+	vector<Ray> rays;
+	vector<Triangle> triangles;
+	vector<Sphere> spheres;
+	vector<Plane> planes;
+	vector<aaBox> boxes;
+	vector<AABB> aabbs;
+	AlignedArray<BVH::LinearBVHNode> nodes;
+	AlignedArray<BVH::WideBVHNode<4> > wide4;
+	AlignedArray<BVH::WideBVHNode<8> > wide8;
+	vector<BVH::WideRay> wide_rays;
+	vector<Vector> inv_dirs;
+
+	// rays from a sphere of radius 4 around the primitives (all in [-1, 1]^3) towards a point among them
+	for (int i = 0; i < BENCH_RAYS; i++) {
+		Vector origin = randomDirection(rng) * 4;
+		Vector target = randomPoint(rng, 1);
+		rays.push_back(Ray(origin, (target - origin).normalize()));
+		wide_rays.push_back(BVH::makeWideRay(rays[i]));
+		inv_dirs.push_back(Vector(wide_rays[i].inv_dir[0], wide_rays[i].inv_dir[1], wide_rays[i].inv_dir[2]));
+	}
+
+	nodes.resize(BENCH_PRIMS);
+	triangles.reserve(BENCH_PRIMS);
+	spheres.reserve(BENCH_PRIMS);
+	planes.reserve(BENCH_PRIMS);
+	boxes.reserve(BENCH_PRIMS);
+	for (int i = 0; i < BENCH_PRIMS; i++) {
+		Vector center = randomPoint(rng, 1);
+		Vector p0 = center + randomPoint(rng, 0.5f), p1 = center + randomPoint(rng, 0.5f), p2 = center + randomPoint(rng, 0.5f);
+		triangles.push_back(Triangle(p0, p1, p2));
+
+		center = randomPoint(rng, 1);
+		spheres.push_back(Sphere(center, 0.05f + 0.3f * rng.nextFloat()));
+
+		center = randomPoint(rng, 1);
+		p0 = center + randomPoint(rng, 1);
+		p1 = center + randomPoint(rng, 1);
+		planes.push_back(Plane(center, p0, p1));
+
+		center = randomPoint(rng, 1);
+		Vector half(0.05f + 0.3f * rng.nextFloat(), 0.05f + 0.3f * rng.nextFloat(), 0.05f + 0.3f * rng.nextFloat());
+		Vector bmin = center - half, bmax = center + half;
+		boxes.push_back(aaBox(bmin, bmax));
+		aabbs.push_back(AABB(bmin, bmax));
+		float lo[3] = { bmin.x, bmin.y, bmin.z }, hi[3] = { bmax.x, bmax.y, bmax.z };
+		for (int axis = 0; axis < 3; axis++) {
+			nodes[i].bmin[axis] = lo[axis];
+			nodes[i].bmax[axis] = hi[axis];
+		}
+	}
+
+	// the same boxes, 4 or 8 per wide node
+	wide4.resize(BENCH_PRIMS / 4);
+	wide8.resize(BENCH_PRIMS / 8);
+	for (int i = 0; i < BENCH_PRIMS; i++) {
+		for (int side = 0; side < 2; side++) {
+			for (int axis = 0; axis < 3; axis++) {
+				float bound = side ? nodes[i].bmax[axis] : nodes[i].bmin[axis];
+				wide4[i / 4].bounds[side][axis][i % 4] = bound;
+				wide8[i / 8].bounds[side][axis][i % 8] = bound;
+			}
+		}
+	}
+
+#ifdef BVH_USE_SSE
+	const char* wide4_name = "BVH node x4 (SSE)";
+#else
+	const char* wide4_name = "BVH node x4 (scalar)";
+#endif
+#ifdef BVH_USE_AVX
+	const char* wide8_name = "BVH node x8 (AVX)";
+#elif defined(BVH_USE_SSE)
+	const char* wide8_name = "BVH node x8 (2 x SSE)";
+#else
+	const char* wide8_name = "BVH node x8 (scalar)";
+#endif
+
+	printf("\nKERNEL BENCHMARK: %d tests per kernel, %d random rays x %d random primitives\n", n_tests, BENCH_RAYS, BENCH_PRIMS);
+	if (RENDER_STATS) printf("(RENDER_STATS is on: the primitive tests also count, build without it for the real timings)\n");
+	printf("%-34s %9s %9s\n", "kernel", "ns/test", "hit rate");
+
+	uint64_t ray_id = 0;	// mailboxes only skip a primitive already tested by the same ray
+
+	printResult("Triangle::intercepts", timeKernel(n_tests, BENCH_PRIMS, 1, [&](int r, int p, float& t) {
+		if (USE_MAIL) rays[r].id = ++ray_id;
+		return (int)triangles[p].intercepts(rays[r], t);
+	}));
+	printResult("Sphere::intercepts", timeKernel(n_tests, BENCH_PRIMS, 1, [&](int r, int p, float& t) {
+		if (USE_MAIL) rays[r].id = ++ray_id;
+		return (int)spheres[p].intercepts(rays[r], t);
+	}));
+	printResult("Plane::intercepts", timeKernel(n_tests, BENCH_PRIMS, 1, [&](int r, int p, float& t) {
+		if (USE_MAIL) rays[r].id = ++ray_id;
+		return (int)planes[p].intercepts(rays[r], t);
+	}));
+	printResult("aaBox::intercepts", timeKernel(n_tests, BENCH_PRIMS, 1, [&](int r, int p, float& t) {
+		if (USE_MAIL) rays[r].id = ++ray_id;
+		return (int)boxes[p].intercepts(rays[r], t);
+	}));
+
+	// box tests: the same boxes with every kernel, so the hit rates must agree
+	printResult("AABB::intercepts", timeKernel(n_tests, BENCH_PRIMS, 1, [&](int r, int p, float& t) {
+		return (int)aabbs[p].intercepts(rays[r], t);
+	}));
+	printResult("BVH node x1 (scalar slab)", timeKernel(n_tests, BENCH_PRIMS, 1, [&](int r, int p, float& t) {
+		float inv_dir[3] = { inv_dirs[r].x, inv_dirs[r].y, inv_dirs[r].z };
+		return (int)BVH::intersect_node(nodes[p], rays[r].origin, inv_dir, t);
+	}));
+	printResult(wide4_name, timeKernel(n_tests, BENCH_PRIMS / 4, 4, [&](int r, int p, float& t) {
+		float t_children[4];
+		int mask = BVH::intersect_children(wide4[p], wide_rays[r], FLT_MAX, t_children);
+		t = t_children[0];
+		return mask;
+	}));
+	printResult(wide8_name, timeKernel(n_tests, BENCH_PRIMS / 8, 8, [&](int r, int p, float& t) {
+		float t_children[8];
+		int mask = BVH::intersect_children(wide8[p], wide_rays[r], FLT_MAX, t_children);
+		t = t_children[0];
+		return mask;
+	}));
+
+	return EXIT_SUCCESS;
+}
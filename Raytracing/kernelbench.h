@@ -0,0 +1,9 @@
+#ifndef KERNELBENCH_H
+#define KERNELBENCH_H
+
+// Microbenchmark of the intersection kernels (Triangle, Sphere, Plane and aaBox intercepts, AABB and the BVH
+// node box tests, scalar and SIMD) on random rays and primitives, apart from any scene or traversal.
+// Prints ns per test and hit rate of every kernel, n_tests tests each. Returns the exit code
+int kernelBenchmark(int n_tests);
+
+#endif
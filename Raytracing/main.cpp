@@ -14,7 +14,10 @@
 #include <stdio.h>
 #include <time.h>
 #include <chrono>
-#include <conio.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 
 #include <GL/glew.h>
 #include <GL/freeglut.h>
@@ -23,11 +26,23 @@
 #include "scene.h"
 #include "grid.h"
 #include "bvh.cpp"
+#include "instance.h"
 #include "maths.h"
 #include "sampler.h"
+#include "scheduler.h"
+#include "wavefront.h"
+#include "checkpoint.h"
+#include "platform.h"
+#include "config.h"
+#include "stats.h"
 #include "constants.h"
+#include "kernelbench.h"
 
 
+#if COST_AOV && !RENDER_STATS
+#error "COST_AOV counts with the render statistics, define RENDER_STATS as 1"
+#endif
+
 #pragma region MACROS
 
 #define CAPTION "Group 6 Ray/Path Tracer"
@@ -38,8 +53,23 @@
 #pragma endregion MACROS
 
 
-// ray Counter (to use for Mailboxing)
-uint64_t rayCounter = 0;
+// ray Counter (to use for Mailboxing, only valid with a single render thread)
+thread_local uint64_t rayCounter = 0;
+
+// Number of images rendered so far, part of the seed of every sample (the same frame is always rendered with the same random numbers)
+unsigned int frame = 0;
+
+// statistics of all the render threads during the last render (RENDER_STATS)
+RenderStats renderStats;
+mutex statsMutex;
+
+// rays traced by the wavefront integrators during the last render
+atomic<uint64_t> wavefrontRays(0);
+
+// rays traced (closest hit and shadow rays) by all the render threads during the last render, and by this thread
+// since it last added its count
+atomic<uint64_t> raysTraced(0);
+thread_local uint64_t threadRays = 0;
 
 //Enable OpenGL drawing.  
 bool drawModeEnabled = true;
@@ -47,6 +77,13 @@ bool drawModeEnabled = true;
 //Draw Mode: 0 - point by point; 1 - line by line; 2 - full frame at once
 int draw_mode = 1;
 
+//Render options of the current scene: defaults, then the "opt" lines of the scene file, then the command line
+RenderConfig config;
+vector<pair<string, string>> cliOptions;
+
+//Number of render threads (0 -> one per hardware thread). With more than one thread the image is rendered in tiles
+int num_threads = 0;
+
 // Points defined by 2 attributes: positions which are stored in vertices array and colors which are stored in colors array
 float *colors;
 float *vertices;
@@ -56,6 +93,22 @@ int size_colors;
 //Array of Pixels to be stored in a file by using DevIL library
 uint8_t *img_Data;
 
+//Samples taken by every pixel (adaptive sampling with SAMPLE_COUNT_AOV)
+vector<int> sampleCounts;
+
+//BVH nodes, grid cells and primitive tests of every pixel (COST_AOV)
+vector<float> costBuffer;
+
+//Progressive rendering: linear rgb sums of the samples taken so far by every pixel, and how many per pixel
+vector<float> accumBuffer;
+int accumSamples = 0;
+
+//Progressive rendering: continue from the last checkpoint (-resume)
+bool resumeRender = false;
+
+//Scene file being rendered
+char scene_name[256];
+
 GLfloat m[16];  //projection matrix initialized by ortho function
 
 GLuint VaoId;
@@ -72,10 +125,6 @@ int RES_X, RES_Y;
 
 int WindowHandle = 0;
 
-double erand48(unsigned short xsubi[3]) {
-	return (double)rand() / (double) RAND_MAX;
-}
-
 /////////////////////////////////////////////////////////////////////// RAYTRACING
 
 //Auxiliary function -> calculates adjusted intersection point
@@ -88,50 +137,114 @@ float remap(float min1, float max1, float min2, float max2, float value) {
 	return min2 + (value - min1) * (max2 - min2) / (max1 - min1);
 }
 
-//Main ray tracing function (index of refraction of medium 1 where the ray is travelling)
-Color rayTracing( Ray ray, int depth, float ior_1, int off_x, int off_y, bool inside = false)
+// Finds the closest intersection of a ray using the selected acceleration structure
+HitRecord traceRay(Ray& ray)
 {
-	Object* obj     = NULL;
-	Object* min_obj = NULL;
-	Vector hit_p;
-
-	float t     = FLT_MAX; 
-	float min_t = FLT_MAX;
-
-	#pragma region ======== GEOMETRY INTERSECTION ========
+	HitRecord hit;
+	hit.obj = NULL;
+	hit.t = FLT_MAX;
+	threadRays++;
 
-	if (acl_str == accel_struct::UGrid) {
+	if (config.accel == accel_struct::UGrid) {
 		//Traverse grid one cell at a time
-		if (!grid.Traverse(ray, &min_obj, hit_p)) {
-			min_obj = NULL;
+		if (!grid.Traverse(ray, &hit.obj, hit.point)) {
+			hit.obj = NULL;
 		}
+		else hit.t = (hit.point - ray.origin).length();
 	}
-	else if (acl_str == accel_struct::Bvh) {
-		if (!bvh.intersect_bvh(ray, &min_obj, hit_p)) {
-			min_obj = NULL;
+	else if (config.accel == accel_struct::Bvh) {
+		if (!bvh.intersect_bvh(ray, &hit.obj, hit.point)) {
+			hit.obj = NULL;
 		}
+		else hit.t = (hit.point - ray.origin).length();
 	}
 	else {
+		float t = FLT_MAX;
+
 		//iterate through all objects in scene to check for interception
 		for (int i = 0; i < scene->getNumObjects(); i++) {
 
-			obj = scene->getObject(i);
+			Object* obj = scene->getObject(i);
 		
-			if (obj->intercepts(ray, t) && (t < min_t)) {
-				min_obj = obj;
-				min_t   = t;
+			if (obj->intercepts(ray, t) && (t < hit.t)) {
+				hit.obj = obj;
+				hit.t   = t;
+			}
+		}
+		if (hit.obj != NULL) hit.point = ray.origin + ray.direction * hit.t;
+	}
+
+	if (hit.obj != NULL) STAT(Hits, 1);
+	return hit;
+}
+
+// Closest hits of a batch of rays for the wavefront integrator, coherent (primary) rays are packet traced through the BVH
+void traceRays(Ray* rays, int n, HitRecord* hits, bool coherent)
+{
+	if (coherent && PACKET_TRACING && config.accel == accel_struct::Bvh) {
+		Object* hit_objs[BVH::MAX_PACKET];
+		Vector hit_points[BVH::MAX_PACKET];
+		float hit_ts[BVH::MAX_PACKET];
+		HitRecordSet set = { hit_objs, hit_points, hit_ts };
+
+		for (int first = 0; first < n; first += PACKET_SIZE) {
+			int m = MIN(PACKET_SIZE, n - first);
+
+			for (int k = 0; k < m; k++) rays[first + k].id = ++rayCounter;
+			bvh.intersect_packet(&rays[first], m, set);
+			threadRays += m;
+
+			for (int k = 0; k < m; k++) {
+				if (hit_objs[k] != NULL) STAT(Hits, 1);
+				hits[first + k].obj = hit_objs[k];
+				hits[first + k].point = hit_points[k];
+				hits[first + k].t = hit_ts[k];
 			}
 		}
+		return;
 	}
 
+	for (int k = 0; k < n; k++) {
+		rays[k].id = ++rayCounter;
+		hits[k] = traceRay(rays[k]);
+	}
+}
+
+// Render features the kernels (rayTracing, Radiance, renderPixel, ...) are compiled for. Every combination is
+// instantiated and the one of the config is picked once per render (selectKernels), so the flags cost nothing per ray
+template <bool PathTracing, bool Antialiasing, bool DepthOfField, bool SoftShadows, bool Skybox>
+struct Features {
+	static const bool PATHTRACING = PathTracing;
+	static const bool ANTIALIASING = Antialiasing;
+	static const bool DEPTH_OF_FIELD = DepthOfField;
+	static const bool SOFT_SHADOWS = SoftShadows;
+	static const bool SKYBOX = Skybox;
+};
+
+//Main ray tracing function (index of refraction of medium 1 where the ray is travelling)
+//first_hit: intersection of the ray if it was already traced (packets of primary rays)
+template <class F>
+Color rayTracing( Ray ray, int depth, float ior_1, Sampler& sampler, bool inside = false, const HitRecord* first_hit = NULL)
+{
+	Object* obj     = NULL;
+	float t     = FLT_MAX; 
+
+	#pragma region ======== GEOMETRY INTERSECTION ========
+
+	STAT(depth == config.max_depth ? PrimaryRays : SecondaryRays, 1);
+	HitRecord hit = (first_hit != NULL) ? *first_hit : traceRay(ray);
+	InstanceHit instance_hit;
+	Object* min_obj = instance_hit.resolve(hit.obj, ray);
+	Vector hit_p = hit.point;
+
 	//Depth map
-	if (acl_str == accel_struct::None && DEPTH_MAP) {
+	if (DEPTH_MAP) {
 		
-		//cerr << min_t << "\n";
+		//cerr << hit.t << "\n";
 
 		float min_depth = 5;
 		float max_depth = 20;
-		float depth = remap(min_depth, max_depth, 1.f, 0.f, min_t);
+		float depth = remap(min_depth, max_depth, 1.f, 0.f, hit.t);
 
 		Color color = Color(depth, depth, depth).clamp();
 
@@ -142,7 +255,7 @@ Color rayTracing( Ray ray, int depth, float ior_1, int off_x, int off_y, bool in
 	
 	//no intersection -> return background
 	if (min_obj == NULL) {
-		if (SKYBOX)	return scene->GetSkyboxColor(ray);
+		if (F::SKYBOX) return scene->GetSkyboxColor(ray);
 		else return scene->GetBackgroundColor();
 	}
 	//interception -> calculate color
@@ -161,7 +274,7 @@ Color rayTracing( Ray ray, int depth, float ior_1, int off_x, int off_y, bool in
 		float fs;
 
 		//fixes floating point errors in intersection
-		Vector interceptNotPrecise = (acl_str == accel_struct::None) ? ray.origin + ray.direction * min_t : hit_p;
+		Vector interceptNotPrecise = hit_p;
 		Vector intercept = offsetIntersection(interceptNotPrecise, min_obj->getNormal(interceptNotPrecise));
 
 		norm = min_obj->getNormal(intercept);
@@ -177,10 +290,13 @@ Color rayTracing( Ray ray, int depth, float ior_1, int off_x, int off_y, bool in
 				light = scene->getLight(i);
 
 				//for antialising + soft shadows cast the multiple rays in the direction of each light (with jitering)
-				if (ANTIALIASING && SOFT_SHADOWS) {
+				if (F::ANTIALIASING && F::SOFT_SHADOWS) {
+					float u, v;
+					sampler.get2D(u, v);
+
 					Vector pos = Vector(
-						light->position.x + LIGHT_SIDE*(off_x + rand_float()) / SPP, 
-						light->position.y + LIGHT_SIDE*(off_y + rand_float()) / SPP,
+						light->position.x + LIGHT_SIDE * u, 
+						light->position.y + LIGHT_SIDE * v,
 						light->position.z);
 					l_dir = (pos - intercept).normalize();
 				}
@@ -191,15 +307,17 @@ Color rayTracing( Ray ray, int depth, float ior_1, int off_x, int off_y, bool in
 				// Shadow Feelers 
 				Ray feeler = Ray(intercept, l_dir);
 				feeler.id = ++rayCounter;
+				threadRays++;
+				STAT(ShadowRays, 1);
 				fs = 1;
 
 				//check for interceptions of feelers
-				if (acl_str == accel_struct::UGrid) {
+				if (config.accel == accel_struct::UGrid) {
 					if (grid.Traverse(feeler)) {
 						fs = 0; //is in shadow
 					}
 				}
-				if (acl_str == accel_struct::Bvh) {
+				else if (config.accel == accel_struct::Bvh) {
 					if (bvh.bool_intersect_bvh(feeler)) {
 						fs = 0;
 					}
@@ -271,7 +389,7 @@ Color rayTracing( Ray ray, int depth, float ior_1, int off_x, int off_y, bool in
 
 				float newior = !inside ? mat->GetRefrIndex() : 1; //MAGIC NUMBER
 				//rayTracing(...)
-				refrCol = rayTracing(refractedRay, depth - 1, newior, off_x, off_y, !inside);
+				refrCol = rayTracing<F>(refractedRay, depth - 1, newior, sampler, !inside);
 
 				//Frenel Equations
 				Rs = pow(fabs((ior_1 * cosOi - newior * cosOt) / (ior_1 * cosOi + newior * cosOt)), 2); //s-polarized (perpendicular)
@@ -296,7 +414,7 @@ Color rayTracing( Ray ray, int depth, float ior_1, int off_x, int off_y, bool in
 			rray.id = ++rayCounter;
 
 			//get color contribution from ray
-			reflCol = rayTracing(rray, depth - 1, ior_1, off_x, off_y, inside);
+			reflCol = rayTracing<F>(rray, depth - 1, ior_1, sampler, inside);
 		}		
 
 		#pragma endregion
@@ -310,37 +428,17 @@ Color rayTracing( Ray ray, int depth, float ior_1, int off_x, int off_y, bool in
 
 /////////////////////////////////////////////////////////////////////// PATHTRACING
 
-Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned short* seed, bool inside = false) {
+template <class F>
+Color Radiance(Ray ray, int depth, float ior_1, Sampler& sampler, bool inside = false, const HitRecord* first_hit = NULL) {
 
 	Object* obj = NULL;
-	Object* min_obj = NULL;
-	Vector hit_p;
-
-	float t = FLT_MAX;
-	float min_t = FLT_MAX;
 
 	#pragma region === GEOMETRY INTERSECTION ===
 
-	if (acl_str == accel_struct::UGrid) {
-		if (!grid.Traverse(ray, &min_obj, hit_p)) 
-			min_obj == NULL;
-	}
-	else if (acl_str == accel_struct::Bvh) {
-		if (!bvh.intersect_bvh(ray, &min_obj, hit_p))
-			min_obj == NULL;
-	}
-	else {
-		//iterate through all objects in scene to check for interception
-		for (int i = 0; i < scene->getNumObjects(); i++) {
-
-			obj = scene->getObject(i);
-
-			if (obj->intercepts(ray, t) && (t < min_t)) {
-				min_obj = obj;
-				min_t = t;
-			}
-		}
-	}
+	STAT(depth == config.max_depth ? PrimaryRays : SecondaryRays, 1);
+	HitRecord hit = (first_hit != NULL) ? *first_hit : traceRay(ray);
+	InstanceHit instance_hit;
+	Object* min_obj = instance_hit.resolve(hit.obj, ray);
 	
 	#pragma endregion
 
@@ -348,7 +446,7 @@ Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned s
 
 	//if no intersection return background
 	if (min_obj == NULL || depth == 0) {
-		if (SKYBOX) {
+		if (F::SKYBOX) {
 			return scene->GetSkyboxColor(ray);
 		}
 		return scene->GetBackgroundColor();
@@ -361,7 +459,7 @@ Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned s
 	Vector norm, norml;
 	float fs;
 
-	Vector interceptNotPrecise = (acl_str == accel_struct::None) ? ray.origin + ray.direction * min_t : hit_p; 
+	Vector interceptNotPrecise = hit.point; 
 
 	norm = min_obj->getNormal(interceptNotPrecise);
 	//properly oriented normal
@@ -379,18 +477,22 @@ Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned s
 	//Russian Roulette
 	float p = MAX3(f.r(), f.g(), f.b());
 
-	if (--depth <= (int) MAX_DEPTH - 5) {
-		if (rand_float() < p) {
+	if (--depth <= config.max_depth - 5) {
+		if (sampler.get1D() < p) {
 			f = f * (1 / p);
 		} else {
+			STAT(RouletteKills, 1);
 			return mat->GetEmission();	
 		}
 	}
 
 	//Ideal diffuse reflection
 	if (mat->GetDiffuse() == 1.0f) {
-		float r1 = 2 * PI * rand_float();
-		float r2 = rand_float();
+		float s1, s2;
+		sampler.get2D(s1, s2);
+
+		float r1 = 2 * PI * s1;
+		float r2 = s2;
 		float r2s = sqrt(r2);
 
 		Vector w = norml;
@@ -427,8 +529,8 @@ Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned s
 			double cos_a_max = sqrt(1 - pow(rad, 2) / ((intercept_out - center) * (intercept_out - center)));
 
 			//sample direction based on random numbers (according to Realist RayTracing)
-			double eps1 = erand48(seed);
-			double eps2 = erand48(seed);
+			float eps1, eps2;
+			sampler.get2D(eps1, eps2);
 			double cos_a = 1 - eps1 + eps1 * cos_a_max;
 			double sin_a = sqrt(1 - cos_a * cos_a);
 			double phi = 2 * PI * eps2;
@@ -438,35 +540,10 @@ Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned s
 
 			Ray feeler = Ray(intercept_out, l);
 			feeler.id = ++rayCounter;
+			STAT(ShadowRays, 1);
 
 			//find shadow feeler interception
-			Object* obj2;
-			Object* min_obj2 = NULL;
-			Vector hit_p2;
-			float t2 = FLT_MAX;
-			float min_t2 = FLT_MAX;
-
-			if (acl_str == accel_struct::UGrid) {
-				if (!grid.Traverse(feeler, &min_obj2, hit_p2)) {
-					min_obj2 = NULL;
-				}
-			}
-			else if (acl_str == accel_struct::Bvh) {
-				if (!bvh.intersect_bvh(feeler, &min_obj2, hit_p2)) {
-					min_obj2 = NULL;
-				}
-			}
-			else {
-				//iterate through all objects in scene to check for interception
-				for (int j = 0; j < scene->getNumObjects(); j++) {
-					obj2 = scene->getObject(j);
-
-					if (obj2->intercepts(feeler, t2) && (t2 < min_t2)) {
-						min_obj2 = obj2;
-						min_t2 = t2;
-					}
-				}
-			}
+			Object* min_obj2 = traceRay(feeler).obj;
 
 			//if intersected (and not with the light itself)
 			if (min_obj2 != NULL && min_obj2 == obj) { //FIXME: make sure this is right
@@ -476,11 +553,11 @@ Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned s
 
 		}
 
-		return mat->GetEmission() + e +  f * Radiance(new_r, depth, ior_1, off_x, off_y, seed);
+		return mat->GetEmission() + e +  f * Radiance<F>(new_r, depth, ior_1, sampler);
 	}
 	else if (mat->GetSpecular() == 1.0f) {
 		Ray new_r = Ray(intercept_out, ray.direction - norm * (2 * (norm * ray.direction)));
-		return mat->GetEmission() + f * Radiance(new_r, depth, ior_1, off_x, off_y, seed);
+		return mat->GetEmission() + f * Radiance<F>(new_r, depth, ior_1, sampler);
 	}
 
 	Ray reflRay = Ray(intercept_out, ray.direction - norm * 2 * (norm * ray.direction)); // ideal dieletric Reflection
@@ -492,7 +569,7 @@ Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned s
 	double cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
 
 	if (cos2t < 0) { // Total internal reflection
-		return mat->GetEmission() + f * Radiance(reflRay, depth, ior_1, off_x, off_y, seed);
+		return mat->GetEmission() + f * Radiance<F>(reflRay, depth, ior_1, sampler);
 	}
 
 	Vector tdir = (ray.direction * nnt - norm * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalize();
@@ -506,11 +583,11 @@ Color Radiance(Ray ray, int depth, float ior_1, int off_x, int off_y, unsigned s
 	double RP = Re / P;
 	double TP = Tr / (1 - P);
 
-	Color col = depth <= (MAX_DEPTH - 2) ? (erand48(seed) < P) ?
-		Radiance(reflRay, depth, ior_1, off_x, off_y, seed) * RP :
-		Radiance(Ray(intercept_out, tdir), depth, ior_1, off_x, off_y, seed) * TP :
-		Radiance(reflRay, depth, ior_1, off_x, off_y, seed) * Re + 
-			Radiance(Ray(intercept_in, tdir), depth, ior_1, off_x, off_y, seed) * Tr;
+	Color col = depth <= (config.max_depth - 2) ? (sampler.get1D() < P) ?
+		Radiance<F>(reflRay, depth, ior_1, sampler) * RP :
+		Radiance<F>(Ray(intercept_out, tdir), depth, ior_1, sampler) * TP :
+		Radiance<F>(reflRay, depth, ior_1, sampler) * Re + 
+			Radiance<F>(Ray(intercept_in, tdir), depth, ior_1, sampler) * Tr;
 
 	return mat->GetEmission() + f * col;
 }
@@ -671,14 +748,14 @@ void drawPoints()
 	checkOpenGLError("ERROR: Could not draw scene.");
 }
 
-ILuint saveImgFile(const char *filename) {
+ILuint saveImgFile(const char *filename, uint8_t* data = img_Data) {
 	ILuint ImageId;
 
 	ilEnable(IL_FILE_OVERWRITE);
 	ilGenImages(1, &ImageId);
 	ilBindImage(ImageId);
 
-	ilTexImage(RES_X, RES_Y, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, img_Data /*Texture*/);
+	ilTexImage(RES_X, RES_Y, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, data /*Texture*/);
 	ilSaveImage(filename);
 
 	ilDisable(IL_FILE_OVERWRITE);
@@ -690,129 +767,369 @@ ILuint saveImgFile(const char *filename) {
 
 /////////////////////////////////////////////////////////////////////// CALLBACKS
 
-// Render function by primary ray casting from the eye towards the scene's objects
-void renderScene()
+Color gammaCorrect(Color color)
 {
-	int index_pos=0;
-	int index_col=0;
-	unsigned int counter = 0;
+	double invGamma = 1 / GAMMA; //clara: 0.0 - 1.0  ; escura: 1.8 - 2.2
+	return Color(pow(color.r(), invGamma), pow(color.g(), invGamma), pow(color.b(), invGamma));
+}
 
-	// Set up the grid with all objects from the scene
-	if (acl_str == accel_struct::UGrid) {
+// Radiance of the samples [first, first + n[ of pixel (x, y), traced as a packet of coherent rays (n <= PACKET_SIZE)
+template <class F>
+void tracePixelSamples(int x, int y, const Sampler& sampler, int first, int n, Color* radiance)
+{
+	Vector pixel;  //viewport coordinates
+	Vector lens;   //lens coords
+
+	bool packets = PACKET_TRACING && config.accel == accel_struct::Bvh;
+
+	Ray rays[PACKET_SIZE];
+	Sampler samplers[PACKET_SIZE];	// state of every sample of the packet
+	Object* hit_objs[PACKET_SIZE];
+	Vector hit_points[PACKET_SIZE];
+	float hit_ts[PACKET_SIZE];
+	HitRecordSet hits = { hit_objs, hit_points, hit_ts };
+
+	for (int k = 0; k < n; k++) {
+		Sampler& s = samplers[k];
+		s = sampler;
+		s.startSample(x, y, first + k);
+
+		float u, v;
+		s.get2D(u, v);
+		pixel.x = x + u;
+		pixel.y = y + v;
+
+		//DOF -> Rays are not shot from the same point but instead from a "lens"
+		if (F::DEPTH_OF_FIELD) {
+			//Sample disk -> the lens samples are mapped to a circle instead of a square
+			if (SAMPLE_DISK) rays[k] = scene->GetCamera()->PrimaryRay(pixel, s);
+			else {
+				s.get2D(lens.x, lens.y);
+				rays[k] = scene->GetCamera()->PrimaryRay(lens, pixel);
+			}
+		}
+		else {
+			rays[k] = scene->GetCamera()->PrimaryRay(pixel);
+		}
 
-		grid = Grid();
+		rays[k].id = ++rayCounter;
+	}
 
-		for (int o = 0; o < scene->getNumObjects(); o++) {
-			grid.addObject(scene->getObject(o));
+	if (packets) {
+		bvh.intersect_packet(rays, n, hits);
+		threadRays += n;
+		for (int k = 0; k < n; k++) if (hit_objs[k] != NULL) STAT(Hits, 1);
+	}
+
+	for (int k = 0; k < n; k++) {
+		HitRecord hit;
+		hit.obj = hit_objs[k];
+		hit.point = hit_points[k];
+		hit.t = hit_ts[k];
+
+		if (F::PATHTRACING) {
+			radiance[k] = Radiance<F>(rays[k], config.max_depth, 1.0, samplers[k], false, packets ? &hit : NULL);
+		}
+		else{
+			radiance[k] = rayTracing<F>(rays[k], config.max_depth, 1.0, samplers[k], false, packets ? &hit : NULL);
 		}
+	}
+}
 
-		grid.Build();
+// Average radiance of the samples [first_sample, first_sample + n_samples[ of pixel (x, y) taken with sampler
+template <class F>
+Color pixelRadiance(int x, int y, const Sampler& sampler, int n_samples, int first_sample = 0)
+{
+	Color color = Color(); 
+	Color radiance[PACKET_SIZE];
+
+	for (int first = 0; first < n_samples; first += PACKET_SIZE) {
+		int n = MIN(PACKET_SIZE, n_samples - first);
+
+		tracePixelSamples<F>(x, y, sampler, first_sample + first, n, radiance);
+		for (int k = 0; k < n; k++) color += radiance[k];
 	}
 
-	if (acl_str == accel_struct::Bvh) {
-		vector<Object*> objs;
+	return color / n_samples;
+}
 
-		for (int o = 0; o < scene->getNumObjects(); o++) {
-			objs.push_back(scene->getObject(o));
+// Adaptive sampling: takes samples until the standard error of the mean displayed luminance of the pixel falls
+// under adaptive_threshold times that mean (ADAPTIVE_DARK_LUMINANCE at least), with at least adaptive_min_spp and
+// at most spp samples.
+// The error is only checked when the number of samples doubles: every check is a chance to stop on a lucky run
+// of samples (which biases the pixel), so few checks keep that bias small
+template <class F>
+Color adaptivePixelRadiance(int x, int y, const Sampler& sampler, int& n_samples)
+{
+	Color color = Color(); 
+	Color radiance[PACKET_SIZE];
+	RunningStats luminance;
+	int next_check = config.adaptive_min_spp;
+
+	n_samples = 0;
+	while (n_samples < config.spp) {
+		int n = MIN(PACKET_SIZE, config.spp - n_samples);
+
+		tracePixelSamples<F>(x, y, sampler, n_samples, n, radiance);
+		for (int k = 0; k < n; k++) {
+			color += radiance[k];
+			// clamped as displayed, a firefly in an already white pixel doesn't need more samples
+			float lum = 0.2126f * radiance[k].r() + 0.7152f * radiance[k].g() + 0.0722f * radiance[k].b();
+			luminance.add(MIN(lum, 1.0f));
+		}
+		n_samples += n;
+
+		if (n_samples >= next_check) {
+			if (luminance.standardError() <= config.adaptive_threshold * MAX(luminance.mean, ADAPTIVE_DARK_LUMINANCE)) break;
+			next_check *= 2;
 		}
+	}
+
+	return color / n_samples;
+}
 
-		bvh.build(objs);
+// Traces all the samples of pixel (x, y) and returns its final (gamma corrected) color
+template <class F>
+Color renderPixel(int x, int y)
+{
+	Color color;
+
+	//Antialiasing -> shoot multiple rays per pixel
+	if (F::ANTIALIASING && config.adaptive) {
+		int n_samples;
+		color = adaptivePixelRadiance<F>(x, y, Sampler(config.sampler, config.spp, frame), n_samples);
+		if (SAMPLE_COUNT_AOV) sampleCounts[y * RES_X + x] = n_samples;
+	}
+	else if (F::ANTIALIASING) {
+		color = pixelRadiance<F>(x, y, Sampler(config.sampler, config.spp, frame), config.spp);
 	}
+	//No Antialiasing -> single ray per pixel
+	else {
+		Vector pixel;
+		pixel.x = x + 0.5;
+		pixel.y = y + 0.5;
 
-	set_rand_seed(time(NULL) * time(NULL));
+		Ray ray = scene->GetCamera()->PrimaryRay(pixel);
+		ray.id = ++rayCounter;
 
-	//For softshadows without antialiasing we replicate each light multiple times
-	if (!ANTIALIASING && SOFT_SHADOWS) {
-		
-		vector<Light*> new_lights;
-		float step = LIGHT_SIDE / SPP;
-		float start = -LIGHT_SIDE / 2 + step / 2;
-		float end = LIGHT_SIDE / 2;
+		Sampler sampler(config.sampler, 1, frame);
+		sampler.startSample(x, y, 0);
+		color = rayTracing<F>(ray, config.max_depth, 1.0, sampler);
+	}
 
-		int limit = scene->getNumLights();
-		for (int k = 0; k < limit; k++) {
-			Light* light = scene->getLight(k);
-			Color avg_col = light->color / (SPP * SPP);
+	return gammaCorrect(color);
+}
 
-			for (float i = start; i < end; i += step) {
-				for (float j = start; j < end; j += step) {
-					Vector pos = Vector(light->position.x + i, light->position.y + j, light->position.z);
-					new_lights.push_back(new Light(pos, avg_col));
-				}
-			}
-		}
-		scene->setLights(new_lights);
+typedef Color (*RenderPixelFunc)(int x, int y);
+typedef Color (*PixelRadianceFunc)(int x, int y, const Sampler& sampler, int n_samples, int first_sample);
+
+// Kernels of the current render, instantiated for its features
+struct Kernels {
+	RenderPixelFunc renderPixel;
+	PixelRadianceFunc pixelRadiance;
+};
+
+Kernels kernels;
+
+// Picks the instantiation of the run time flags, one flag at a time (N flags left)
+template <int N, bool... Flags>
+struct KernelTable {
+	static Kernels select(const bool* flags) {
+		return flags[sizeof...(Flags)] ?
+			KernelTable<N - 1, Flags..., true>::select(flags) : KernelTable<N - 1, Flags..., false>::select(flags);
 	}
+};
 
-	for (int y = 0; y < RES_Y; y++)
-	{
-		unsigned short seed[3] = { 0,0,y * y * y }; //Generate seed for radiance
+template <bool... Flags>
+struct KernelTable<0, Flags...> {
+	static Kernels select(const bool*) {
+		Kernels k = { renderPixel<Features<Flags...>>, pixelRadiance<Features<Flags...>> };
+		return k;
+	}
+};
 
-		for (int x = 0; x < RES_X; x++)
-		{
-			Color color = Color(); 
-			Vector pixel;  //viewport coordinates
-			Vector lens;   //lens coords
-
-			//Antialiasing -> shoot multiple rays per pixel
-			if (ANTIALIASING) {
-				for (int i = 0; i < SPP; i++) {
-					for (int j = 0; j < SPP; j++) {
-						Ray* ray = nullptr;
-
-						if (s_mode == sample_mode::jitter) {
-							pixel.x = x + (i + rand_float()) / SPP;
-							pixel.y = y + (j + rand_float()) / SPP;
-						}
-						else if (s_mode == sample_mode::tent) {
-							double r1 = 2 * erand48(seed), dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-							double r2 = 2 * erand48(seed), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
+// The skybox is only used if the scene has one, the DOF needs antialiasing
+void selectKernels()
+{
+	bool flags[] = { config.pathtracing, config.antialiasing, config.antialiasing && config.depth_of_field,
+		config.soft_shadows, config.skybox && scene->GetSkyBoxFlg() };
+	kernels = KernelTable<5>::select(flags);
+}
 
-							pixel.x = x + (0.5 + dx) / SPP;
-							pixel.y = y + (0.5 + dy) / SPP;
-						}
+// true -> path tracing is done by WavefrontIntegrator (whole tiles) instead of renderPixel (fixed number of samples only)
+bool useWavefront()
+{
+	return config.pathtracing && config.wavefront && config.antialiasing && !config.adaptive && !config.progressive && !COST_AOV;
+}
 
-						//DOF -> Rays are not shot from the same point but instead from a "lens"
-						if (DEPTH_OF_FIELD) {
-							//Sample disk -> alternative to jitering that displaces rays in a circle
-							if (SAMPLE_DISK) lens = sample_unit_disk();
-							else {
-								lens.x = (i + rand_float()) / SPP;
-								lens.y = (j + rand_float()) / SPP;
-							}
-							ray = &scene->GetCamera()->PrimaryRay(lens, pixel);
-						}
-						else {
-							ray = &scene->GetCamera()->PrimaryRay(pixel);
-						}
+WavefrontSettings wavefrontSettings()
+{
+	WavefrontSettings settings;
+	settings.spp = config.spp;
+	settings.max_depth = config.max_depth;
+	settings.wave_size = WAVE_SIZE;
+	settings.sampler = config.sampler;
+	settings.depth_of_field = config.depth_of_field;
+	settings.sample_disk = SAMPLE_DISK;
+	settings.skybox = config.skybox && scene->GetSkyBoxFlg();
+	settings.test_intersect = TEST_INTERSECT;
+	settings.frame = frame;
+	return settings;
+}
 
-						ray->id = ++rayCounter;
+// Adds the counters of the calling thread to the render's, at the end of every render thread
+void mergeThreadStats()
+{
+	raysTraced += threadRays;
+	threadRays = 0;
+
+#if RENDER_STATS
+	lock_guard<mutex> lock(statsMutex);
+	renderStats.add(threadStats());
+	threadStats().clear();
+#endif
+}
 
-						if (PATHTRACING) {
-							color += Radiance(*ray, MAX_DEPTH, 1.0, i, j, seed);
-						}
-						else{
-							color += rayTracing(*ray, MAX_DEPTH, 1.0, i, j);
-						}
-						
-					}
-				}
-				color = color / (SPP * SPP);
+#if COST_AOV
+// Adds the traversal work of the calling thread since before to the cost of pixel (x, y)
+void addPixelCost(int x, int y, const RenderStats& before)
+{
+	const RenderStats& now = threadStats();
+	float* cost = &costBuffer[3 * (y * RES_X + x)];
+
+	cost[0] += (float)(now.count[BvhNodes] - before.count[BvhNodes]);
+	cost[1] += (float)(now.count[GridCells] - before.count[GridCells]);
+	for (int i = TriangleTests; i <= PlaneTests; i++) cost[2] += (float)(now.count[i] - before.count[i]);
+}
+#endif
+
+// Traces pixel (x, y) with the kernels of the render (and records its cost with COST_AOV)
+Color tracePixel(int x, int y)
+{
+#if COST_AOV
+	RenderStats before = threadStats();
+	Color color = kernels.renderPixel(x, y);
+	addPixelCost(x, y, before);
+	return color;
+#else
+	return kernels.renderPixel(x, y);
+#endif
+}
 
+// Renders one tile, writing straight into the image buffer (the main thread draws it once it is finished)
+void renderTile(const Tile& tile, WavefrontIntegrator* wavefront = NULL)
+{
+	vector<float> radiance;
+
+	if (wavefront != NULL) {
+		radiance.resize(3 * (tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+		wavefront->render(tile, &radiance[0]);
+	}
+
+	int p = 0;
+	for (int y = tile.y0; y < tile.y1; y++) {
+		for (int x = tile.x0; x < tile.x1; x++, p++) {
+			Color color = (wavefront != NULL) ?
+				gammaCorrect(Color(radiance[3 * p], radiance[3 * p + 1], radiance[3 * p + 2])) : tracePixel(x, y);
+			int index = 3 * (y * RES_X + x);
+
+			img_Data[index]     = u8fromfloat((float)color.r());
+			img_Data[index + 1] = u8fromfloat((float)color.g());
+			img_Data[index + 2] = u8fromfloat((float)color.b());
+		}
+	}
+}
+
+// Copies finished tiles of the image to the (full frame) drawing buffer
+void drawTiles(const vector<Tile>& tiles)
+{
+	for (const Tile& tile : tiles) {
+		for (int y = tile.y0; y < tile.y1; y++) {
+			for (int i = 3 * (y * RES_X + tile.x0); i < 3 * (y * RES_X + tile.x1); i++) {
+				colors[i] = img_Data[i] / 255.0f;
 			}
-			//No Antialiasing -> single ray per pixel
-			else {
-				pixel.x = x + 0.5;
-				pixel.y = y + 0.5;
+		}
+	}
+}
 
-				Ray ray = scene->GetCamera()->PrimaryRay(pixel);
-				ray.id = ++rayCounter;
+// Full frame drawing buffers: every pixel has a fixed position, black until it is rendered
+void clearFullFrame()
+{
+	for (int i = 0; i < RES_X * RES_Y; i++) {
+		vertices[2 * i] = (float)(i % RES_X);
+		vertices[2 * i + 1] = (float)(i / RES_X);
+		colors[3 * i] = colors[3 * i + 1] = colors[3 * i + 2] = 0.0f;
+	}
+}
 
-				color += rayTracing(ray, MAX_DEPTH, 1.0, 0, 0);
+// Multithreaded render: the image is split in tiles which are handed to the workers by a work stealing scheduler
+void renderTiles()
+{
+	if (drawModeEnabled) clearFullFrame();
+
+	TileScheduler scheduler(RES_X, RES_Y, TILE_SIZE, num_threads);
+	vector<thread> workers;
+
+	for (int w = 0; w < num_threads; w++) {
+		workers.push_back(thread([&scheduler, w]() {
+			WavefrontIntegrator wavefront(scene, traceRays, wavefrontSettings());
+
+			Tile tile;
+			while (scheduler.next(w, tile)) {
+				renderTile(tile, useWavefront() ? &wavefront : NULL);
+				scheduler.done(tile);
 			}
 
-			double invGamma = 1 / GAMMA; //clara: 0.0 - 1.0  ; escura: 1.8 - 2.2
-			color = Color(pow(color.r(), invGamma), pow(color.g(), invGamma), pow(color.b(), invGamma));
+			wavefrontRays += wavefront.getRayCount();
+
+			mergeThreadStats();
+		}));
+	}
+
+	// only the main thread owns the GL context, so it refreshes the window while the workers render, with the
+	// tiles they have finished (the others are still being written)
+	vector<Tile> finished;
+	if (drawModeEnabled) {
+		while (!scheduler.finished()) {
+			this_thread::sleep_for(chrono::milliseconds(250));
+			scheduler.takeFinished(finished);
+			drawTiles(finished);
+			finished.clear();
+			drawPoints();
+		}
+	}
+
+	for (thread& worker : workers) worker.join();
+
+	if (drawModeEnabled) {
+		scheduler.takeFinished(finished);
+		drawTiles(finished);
+		drawPoints();
+	}
+}
+
+// Single threaded render, drawing the image point by point, line by line or at the end
+void renderScanlines()
+{
+	int index_pos=0;
+	int index_col=0;
+	unsigned int counter = 0;
+
+	WavefrontIntegrator wavefront(scene, traceRays, wavefrontSettings());
+	vector<float> radiance(3 * RES_X);
+
+	for (int y = 0; y < RES_Y; y++)
+	{
+		// the wavefront integrator renders the whole line at once
+		if (useWavefront()) {
+			Tile line = { 0, y, RES_X, y + 1 };
+			wavefront.render(line, &radiance[0]);
+		}
+
+		for (int x = 0; x < RES_X; x++)
+		{
+			Color color = useWavefront() ?
+				gammaCorrect(Color(radiance[3 * x], radiance[3 * x + 1], radiance[3 * x + 2])) : tracePixel(x, y);
 
 			//Create Image
 			img_Data[counter++] = u8fromfloat((float)color.r());
@@ -845,14 +1162,406 @@ void renderScene()
 	}
 	if (draw_mode == 2 && drawModeEnabled)        //full frame at once
 		drawPoints();
+
+	wavefrontRays += wavefront.getRayCount();
+	mergeThreadStats();
+}
+
+// Builds the selected acceleration structure over the objects of the scene
+void buildAccelStructure()
+{
+	// the bottom level: a BVH per prototype, shared by its instances and kept while the BVH settings don't change
+	for (int p = 0; p < scene->getNumPrototypes(); p++) {
+		scene->getPrototype(p)->build(config.builder, config.bvh_width, num_threads);
+	}
+
+	// Set up the grid with all objects from the scene
+	if (config.accel == accel_struct::UGrid) {
+
+		grid = Grid();
+		grid.setLayout(config.grid_cells);
+		grid.setLevels(config.grid_levels, GRID_MAX_CELL_OBJECTS);
+
+		for (int o = 0; o < scene->getNumObjects(); o++) {
+			grid.addObject(scene->getObject(o));
+		}
+
+		grid.Build();
+	}
+
+	if (config.accel == accel_struct::Bvh) {
+		vector<Object*> objs;
+
+		for (int o = 0; o < scene->getNumObjects(); o++) {
+			objs.push_back(scene->getObject(o));
+		}
+
+		bvh.setBuilder(config.builder);
+		bvh.setWidth(config.bvh_width);
+		bvh.setBuildThreads(num_threads);
+		bvh.setSAHParams(SAH_BINS, SAH_TRAVERSAL_COST, SAH_INTERSECTION_COST, SAH_MAX_LEAF);
+		bvh.setSpatialSplits(SBVH_ALPHA, SBVH_MAX_DUPLICATION);
+
+		// the tree of the same geometry and settings is reused from the cache file of the scene
+		string cache_file = string(scene_name) + ".bvhcache";
+		if (!config.accel_cache || !bvh.load(cache_file.c_str(), scene->getGeometryHash(), objs)) {
+			bvh.build(objs);
+			if (config.accel_cache && !bvh.save(cache_file.c_str(), scene->getGeometryHash(), objs)) {
+				printf("Error saving the BVH cache %s\n", cache_file.c_str());
+			}
+		}
+	}
+}
+
+// Memory of the acceleration structure in use
+size_t accelMemoryBytes()
+{
+	size_t bytes = 0;
+	for (int p = 0; p < scene->getNumPrototypes(); p++) bytes += scene->getPrototype(p)->memoryBytes();
+
+	if (config.accel == accel_struct::UGrid) return bytes + grid.memoryBytes();
+	if (config.accel == accel_struct::Bvh) return bytes + bvh.memoryBytes();
+	return bytes;
+}
+
+// Adds to sums the linear radiance (rgb per pixel) of the samples [first_sample, first_sample + n_samples[ of
+// every pixel of the image, summed, on all the render threads
+void renderRadiance(const Sampler& sampler, int first_sample, int n_samples, vector<float>& sums)
+{
+	TileScheduler scheduler(RES_X, RES_Y, TILE_SIZE, num_threads);
+	vector<thread> workers;
+
+	for (int w = 0; w < num_threads; w++) {
+		workers.push_back(thread([&scheduler, &sampler, &sums, first_sample, n_samples, w]() {
+			Tile tile;
+			while (scheduler.next(w, tile)) {
+				for (int y = tile.y0; y < tile.y1; y++) {
+					for (int x = tile.x0; x < tile.x1; x++) {
+#if COST_AOV
+						RenderStats before = threadStats();
+#endif
+						Color color = kernels.pixelRadiance(x, y, sampler, n_samples, first_sample) * n_samples;
+#if COST_AOV
+						addPixelCost(x, y, before);
+#endif
+						int index = 3 * (y * RES_X + x);
+
+						sums[index] += color.r();
+						sums[index + 1] += color.g();
+						sums[index + 2] += color.b();
+					}
+				}
+				scheduler.done();
+			}
+
+			mergeThreadStats();
+		}));
+	}
+
+	for (thread& worker : workers) worker.join();
+}
+
+// Writes the average of the accumulated samples to the image and the (full frame) drawing buffer
+void resolveAccumBuffer()
+{
+	for (int i = 0; i < RES_X * RES_Y; i++) {
+		int index = 3 * i;
+		Color color = gammaCorrect(Color(accumBuffer[index], accumBuffer[index + 1], accumBuffer[index + 2]) / accumSamples);
+
+		img_Data[index]     = u8fromfloat((float)color.r());
+		img_Data[index + 1] = u8fromfloat((float)color.g());
+		img_Data[index + 2] = u8fromfloat((float)color.b());
+
+		if (drawModeEnabled) {
+			colors[index]     = (float)color.r();
+			colors[index + 1] = (float)color.g();
+			colors[index + 2] = (float)color.b();
+		}
+	}
+}
+
+// Snapshot of the progressive render, for a checkpoint
+Checkpoint progressiveCheckpoint(uint64_t scene_hash)
+{
+	Checkpoint checkpoint;
+	checkpoint.scene_hash = scene_hash;
+	checkpoint.config_hash = hashString(describeEstimator(config));
+	checkpoint.res_x = RES_X;
+	checkpoint.res_y = RES_Y;
+	checkpoint.sampler = config.sampler;
+	checkpoint.target_samples = config.spp;
+	checkpoint.frame = frame;
+	checkpoint.samples = accumSamples;
+	checkpoint.accum = accumBuffer;
+	return checkpoint;
+}
+
+// Loads the last checkpoint if it belongs to this render (same scene file and settings)
+bool resumeProgressive(uint64_t scene_hash)
+{
+	Checkpoint checkpoint;
+
+	if (!loadCheckpoint(CHECKPOINT_FILE, checkpoint)) {
+		printf("No checkpoint to resume (%s)\n", CHECKPOINT_FILE);
+		return false;
+	}
+
+	if (checkpoint.scene_hash != scene_hash || checkpoint.res_x != RES_X || checkpoint.res_y != RES_Y
+		|| checkpoint.sampler != config.sampler || checkpoint.target_samples != config.spp) {
+		printf("The checkpoint belongs to another scene or render settings, starting over\n");
+		return false;
+	}
+
+	// its samples were traced with other options (e.g. -max-depth or -pathtracing on the command line)
+	if (checkpoint.config_hash != hashString(describeEstimator(config))) {
+		printf("The checkpoint was rendered with other render options, starting over\n");
+		return false;
+	}
+
+	frame = checkpoint.frame;
+	accumSamples = checkpoint.samples;
+	accumBuffer.swap(checkpoint.accum);
+	printf("Resuming from %d samples per pixel\n", accumSamples);
+	return true;
+}
+
+// Progressive render: every pass adds PASS_SAMPLES more samples of every pixel to the accumulation buffer (the
+// samplers just continue their sequences) and shows the image so far. Stops at spp samples per pixel or when the
+// pass that ends past time-budget seconds finishes.
+// Every CHECKPOINT_INTERVAL seconds (and at the end) the accumulation buffer is saved by a background thread
+void renderProgressive()
+{
+	if (drawModeEnabled) clearFullFrame();
+
+	uint64_t scene_hash = hashFile(scene_name);
+
+	if (!resumeRender || !resumeProgressive(scene_hash)) {
+		accumBuffer.assign(3 * RES_X * RES_Y, 0.0f);
+		accumSamples = 0;
+	}
+	resumeRender = false;
+
+	if (accumSamples > 0) {
+		resolveAccumBuffer();
+		if (drawModeEnabled) drawPoints();
+	}
+
+	CheckpointWriter* checkpoints = (CHECKPOINT_INTERVAL > 0) ? new CheckpointWriter(CHECKPOINT_FILE) : NULL;
+
+	Sampler sampler(config.sampler, config.spp, frame);
+	auto timeStart = chrono::high_resolution_clock::now();
+	double last_checkpoint = 0;
+
+	while (accumSamples < config.spp) {
+		int n = MIN(PASS_SAMPLES, config.spp - accumSamples);
+
+		renderRadiance(sampler, accumSamples, n, accumBuffer);
+		accumSamples += n;
+
+		resolveAccumBuffer();
+		if (drawModeEnabled) drawPoints();
+
+		double elapsed = chrono::duration<double>(chrono::high_resolution_clock::now() - timeStart).count();
+		printf("\rProgressive: %d samples per pixel (%.1f s)", accumSamples, elapsed);
+		fflush(stdout);
+
+		// skipped if the previous checkpoint is still being written
+		if (checkpoints != NULL && elapsed - last_checkpoint >= CHECKPOINT_INTERVAL) {
+			Checkpoint checkpoint = progressiveCheckpoint(scene_hash);
+			if (checkpoints->submit(checkpoint)) last_checkpoint = elapsed;
+		}
+
+		if (config.time_budget > 0 && elapsed >= config.time_budget) break;
+	}
+	printf("\n");
+
+	if (checkpoints != NULL) {
+		Checkpoint checkpoint = progressiveCheckpoint(scene_hash);
+		checkpoints->submit(checkpoint, true);
+		delete checkpoints;
+	}
+}
+
+// Convergence of the samplers: RMSE against a reference (Random, ref_samples per pixel) of the images rendered
+// with every sampler at 1, 4, 16, ... samples per pixel. The radiance is clamped to [0, 1] (displayed values).
+// The reference is independent of every tested sequence: a Sobol or Halton reference would share its sample
+// indices (frame * spp + index) and per pixel scrambling with the tested images, which favours that sampler
+void samplerBenchmark(int ref_samples)
+{
+	const sampler_type types[] = { sampler_type::Random, sampler_type::Stratified, sampler_type::Halton, sampler_type::Sobol, sampler_type::BlueNoise };
+	const int n_types = sizeof(types) / sizeof(types[0]);
+
+	vector<float> reference, image;
+
+	selectKernels();
+	printf("\nSAMPLER BENCHMARK: reference with %d samples per pixel\n", ref_samples);
+	reference.assign(3 * RES_X * RES_Y, 0.0f);
+	renderRadiance(Sampler(sampler_type::Random, ref_samples, 0), 0, ref_samples, reference);
+
+	printf("%8s", "spp");
+	for (int t = 0; t < n_types; t++) printf(" %11s", Sampler::name(types[t]));
+	printf("\n");
+
+	for (int n = 1; n * 16 <= ref_samples; n *= 4) {
+		printf("%8d", n);
+
+		for (int t = 0; t < n_types; t++) {
+			// frame 1: the Random images do not reuse the reference's random streams either
+			image.assign(3 * RES_X * RES_Y, 0.0f);
+			renderRadiance(Sampler(types[t], n, 1), 0, n, image);
+
+			double err = 0;
+			for (size_t i = 0; i < image.size(); i++) {
+				double d = CLAMP(0.0f, image[i] / n, 1.0f) - CLAMP(0.0f, reference[i] / ref_samples, 1.0f);
+				err += d * d;
+			}
+			printf(" %11.5f", sqrt(err / image.size()));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+}
+
+// Sample count AOV: white -> spp. Also prints the average
+void saveSampleCounts(const char* filename)
+{
+	vector<uint8_t> aov(3 * RES_X * RES_Y);
+	double total = 0;
+
+	for (int i = 0; i < RES_X * RES_Y; i++) {
+		uint8_t value = u8fromfloat((float)sampleCounts[i] / config.spp);
+		aov[3 * i] = aov[3 * i + 1] = aov[3 * i + 2] = value;
+		total += sampleCounts[i];
+	}
+
+	printf("Adaptive sampling: %.1f samples per pixel on average\n", total / (RES_X * RES_Y));
+
+	if (saveImgFile(filename, &aov[0]) != IL_NO_ERROR) printf("Error saving the sample count AOV\n");
+}
+
+// False colour ramp for value in [0, 1]: blue, cyan, green, yellow, red
+Color heatColor(float value)
+{
+	Color stops[] = { Color(0, 0, 1), Color(0, 1, 1), Color(0, 1, 0), Color(1, 1, 0), Color(1, 0, 0) };
+	float x = CLAMP(0.0f, value, 1.0f) * 4;
+	int i = MIN((int)x, 3);
+	float f = x - i;
+	return stops[i] * (1 - f) + stops[i + 1] * f;
+}
+
+// Traversal cost AOV: heatmap of the total work (nodes + cells + tests) of every pixel, red -> 99th percentile
+// (a few pathological pixels would leave the rest blue), and the raw counts as a PFM image (bottom row first,
+// like img_Data). Also prints the averages
+void saveCostAOV(const char* png_file, const char* pfm_file)
+{
+	int n_pixels = RES_X * RES_Y;
+	vector<float> total(n_pixels);
+	double sums[3] = { 0, 0, 0 };
+
+	for (int i = 0; i < n_pixels; i++) {
+		total[i] = costBuffer[3 * i] + costBuffer[3 * i + 1] + costBuffer[3 * i + 2];
+		for (int c = 0; c < 3; c++) sums[c] += costBuffer[3 * i + c];
+	}
+
+	printf("Traversal cost per pixel: %.1f BVH nodes, %.1f grid cells, %.1f primitive tests\n",
+		sums[0] / n_pixels, sums[1] / n_pixels, sums[2] / n_pixels);
+
+	vector<float> sorted = total;
+	nth_element(sorted.begin(), sorted.begin() + n_pixels * 99 / 100, sorted.end());
+	float scale = sorted[n_pixels * 99 / 100] > 0 ? 1.0f / sorted[n_pixels * 99 / 100] : 0.0f;
+
+	vector<uint8_t> aov(3 * n_pixels);
+	for (int i = 0; i < n_pixels; i++) {
+		Color color = heatColor(total[i] * scale);
+		aov[3 * i] = u8fromfloat(color.r());
+		aov[3 * i + 1] = u8fromfloat(color.g());
+		aov[3 * i + 2] = u8fromfloat(color.b());
+	}
+	if (saveImgFile(png_file, &aov[0]) != IL_NO_ERROR) printf("Error saving the traversal cost AOV\n");
+
+	// PFM: little endian (negative scale) rgb floats
+	FILE* file = fopen(pfm_file, "wb");
+	if (file == NULL) {
+		printf("Error saving %s\n", pfm_file);
+		return;
+	}
+	fprintf(file, "PF\n%d %d\n-1.0\n", RES_X, RES_Y);
+	fwrite(&costBuffer[0], sizeof(float), costBuffer.size(), file);
+	fclose(file);
+}
+
+// Renders the image (img_Data and the window) with the acceleration structure already built, returns the render seconds
+double renderImage()
+{
+	selectKernels();
+
+	//For softshadows without antialiasing we replicate each light multiple times (a grid of spp lights)
+	if (!config.antialiasing && config.soft_shadows) {
+		
+		vector<Light*> new_lights;
+		int side = MAX(1, (int)(sqrt((float)config.spp) + 0.5f));
+		float step = LIGHT_SIDE / side;
+		float start = -LIGHT_SIDE / 2 + step / 2;
+		float end = LIGHT_SIDE / 2;
+
+		int limit = scene->getNumLights();
+		for (int k = 0; k < limit; k++) {
+			Light* light = scene->getLight(k);
+			Color avg_col = light->color / (side * side);
+
+			for (float i = start; i < end; i += step) {
+				for (float j = start; j < end; j += step) {
+					Vector pos = Vector(light->position.x + i, light->position.y + j, light->position.z);
+					new_lights.push_back(new Light(pos, avg_col));
+				}
+			}
+		}
+		scene->setLights(new_lights);
+	}
+
+	renderStats.clear();
+	wavefrontRays = 0;
+	raysTraced = 0;
+	if (config.adaptive && SAMPLE_COUNT_AOV) sampleCounts.assign(RES_X * RES_Y, 0);
+	if (COST_AOV) costBuffer.assign(3 * RES_X * RES_Y, 0.0f);
+	auto timeStart = chrono::high_resolution_clock::now();
+
+	if (config.antialiasing && config.progressive) renderProgressive();
+	else if (num_threads > 1) renderTiles();
+	else renderScanlines();
+
+	auto timeEnd = chrono::high_resolution_clock::now();
+	double render_sec = chrono::duration<double>(timeEnd - timeStart).count();
+	frame++;
 		 
 	printf("Drawing finished!\n"); 	
+	printf("Rays: %llu (%.2f Mrays/s)\n", (unsigned long long)raysTraced.load(), raysTraced / render_sec / 1e6);
+
+#if RENDER_STATS
+	renderStats.print(render_sec);
+#endif
+
+	if (useWavefront()) {
+		printf("Wavefront rays: %llu (%.2f Mrays/s)\n", (unsigned long long)wavefrontRays.load(), wavefrontRays / render_sec / 1e6);
+	}
+
+	return render_sec;
+}
+
+// Render function by primary ray casting from the eye towards the scene's objects
+void renderScene()
+{
+	buildAccelStructure();
+	renderImage();
 
 	if (saveImgFile("RT_Output.png") != IL_NO_ERROR) {
 		printf("Error saving Image file\n");
 		exit(0);
 	}
 	printf("Image file created\n");
+
+	if (config.adaptive && SAMPLE_COUNT_AOV) saveSampleCounts("RT_Samples.png");
+	if (COST_AOV) saveCostAOV("RT_Cost.png", "RT_Cost.pfm");
 	glFlush();
 }
 
@@ -959,11 +1668,12 @@ void init(int argc, char* argv[])
 	
 }
 
+void load_scene(const char* filename);
+
 void init_scene(void)
 {
 	char scenes_dir[70] = "P3D_Scenes/";
 	char input_user[50];
-	char scene_name[70];
 
 	while (true) {
 		cout << "Input the Scene Name: ";
@@ -979,17 +1689,198 @@ void init_scene(void)
 			break;
 	}
 
+	load_scene(scene_name);
+}
+
+// Loads a scene file and allocates the image buffer
+void load_scene(const char* filename)
+{
+	if (filename != scene_name) strcpy_s(scene_name, sizeof(scene_name), filename);
+
 	scene = new Scene();
 	scene->load_p3f(scene_name);
 	RES_X = scene->GetCamera()->GetResX();
 	RES_Y = scene->GetCamera()->GetResY();
 	printf("\nResolutionX = %d  ResolutionY= %d.\n", RES_X, RES_Y);
 
+	config = RenderConfig();
+	for (const pair<string, string>& option : scene->getOptions()) setOption(config, option.first, option.second);
+	for (const pair<string, string>& option : cliOptions) setOption(config, option.first, option.second);
+	printf("RENDER CONFIG: %s\n", describeConfig(config).c_str());
+
 	// Pixel buffer to be used in the Save Image function
 	img_Data = (uint8_t*)malloc(3 * RES_X*RES_Y * sizeof(uint8_t));
 	if (img_Data == NULL) exit(1);
 }
 
+// Headless render (-scene): no window nor GL context, and no prompts. Prints the timings as one JSON line
+int batchRender(const char* scene_file, const char* output_file)
+{
+	auto t0 = chrono::high_resolution_clock::now();
+
+	ifstream file(scene_file, ios::in);
+	if (file.fail()) {
+		printf("Error opening P3F file %s\n", scene_file);
+		return EXIT_FAILURE;
+	}
+	file.close();
+	load_scene(scene_file);
+
+	auto t1 = chrono::high_resolution_clock::now();
+	buildAccelStructure();
+	auto t2 = chrono::high_resolution_clock::now();
+	double render_sec = renderImage();
+	auto t3 = chrono::high_resolution_clock::now();
+	ILenum error = saveImgFile(output_file);
+	auto t4 = chrono::high_resolution_clock::now();
+
+	if (config.adaptive && SAMPLE_COUNT_AOV) saveSampleCounts("RT_Samples.png");
+	if (COST_AOV) saveCostAOV("RT_Cost.png", "RT_Cost.pfm");
+
+	delete(scene);
+	free(img_Data);
+
+	if (error != IL_NO_ERROR) {
+		printf("Error saving Image file %s\n", output_file);
+		return EXIT_FAILURE;
+	}
+
+	printf("{\"res_x\": %d, \"res_y\": %d, \"accel\": \"%s\", \"spp\": %d, \"threads\": %d, "
+		"\"load_s\": %.4f, \"build_s\": %.4f, \"render_s\": %.4f, \"save_s\": %.4f}\n",
+		RES_X, RES_Y, accelName(config.accel), config.antialiasing ? config.spp : 1, num_threads,
+		chrono::duration<double>(t1 - t0).count(), chrono::duration<double>(t2 - t1).count(),
+		render_sec, chrono::duration<double>(t4 - t3).count());
+	return EXIT_SUCCESS;
+}
+
+// Scenes of the benchmark (P3D_Scenes), every family from its smallest to its largest scene
+const char* benchScenes[] = { "tri_low", "mount_low", "mount_high", "mount_very_high",
+	"balls_low", "balls_medium", "balls_high", "balls_instanced", "path_balls_low", "path_balls", "path_dof", "path_glass", "path_mirror" };
+
+double median(vector<double> values)
+{
+	sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+// Benchmark (-bench): every scene with every acceleration structure and both integrators (rayTracing and Radiance),
+// repeats times each, at BENCH_SPP samples per pixel. Every repeat reloads the scene and renders frame 0, so they all
+// trace the same rays. Prints the medians of every run as one JSON line, and also writes them to out_file (CSV if it
+// ends in .csv). The peak memory is that of the run above the memory in use when it starts, where the platform can
+// restart the peak (the scenes leak their objects, so the process's grows run after run), else the process's so far
+int benchmark(int repeats, const char* out_file)
+{
+	// the grid with both cell layouts, the BVH with the SAH, linear and spatial split builders
+	struct BenchAccel {
+		const char* name;
+		accel_struct accel;
+		grid_layout grid_cells;
+		bvh_builder builder;
+	};
+	const BenchAccel accels[] = { { "none", accel_struct::None, grid_layout::Csr, bvh_builder::Sah },
+		{ "grid", accel_struct::UGrid, grid_layout::Csr, bvh_builder::Sah },
+		{ "grid-vectors", accel_struct::UGrid, grid_layout::CellVectors, bvh_builder::Sah },
+		{ "bvh", accel_struct::Bvh, grid_layout::Csr, bvh_builder::Sah },
+		{ "bvh-lbvh", accel_struct::Bvh, grid_layout::Csr, bvh_builder::Lbvh },
+		{ "bvh-sbvh", accel_struct::Bvh, grid_layout::Csr, bvh_builder::Sbvh } };
+	const int n_scenes = sizeof(benchScenes) / sizeof(benchScenes[0]);
+
+	// -spp overrides BENCH_SPP
+	RenderConfig cli;
+	cli.spp = BENCH_SPP;
+	for (const pair<string, string>& option : cliOptions) setOption(cli, option.first, option.second);
+	int bench_spp = cli.spp;
+
+	bool run_peak = resetPeakMemory();
+	const char* peak_name = run_peak ? "peak_mb" : "process_peak_mb";
+	printf("Benchmark: %d repeats, %d samples per pixel (with antialiasing), %s memory peaks\n", repeats,
+		bench_spp, run_peak ? "per run" : "process");
+
+	FILE* out = NULL;
+	bool csv = false;
+	if (out_file != NULL) {
+		out = fopen(out_file, "w");
+		if (out == NULL) {
+			printf("Error opening %s\n", out_file);
+			return EXIT_FAILURE;
+		}
+		size_t len = strlen(out_file);
+		csv = len >= 4 && strcmp(out_file + len - 4, ".csv") == 0;
+		if (csv) fprintf(out, "scene,accel,integrator,res_x,res_y,spp,threads,repeats,load_s,build_s,render_s,render_min_s,rays,mrays_s,accel_mb,%s\n", peak_name);
+	}
+
+	for (int s = 0; s < n_scenes; s++) {
+		string file = string("P3D_Scenes/") + benchScenes[s] + ".p3f";
+		if (ifstream(file.c_str()).fail()) {
+			printf("Benchmark: %s not found, skipped\n", file.c_str());
+			continue;
+		}
+
+		for (const BenchAccel& accel : accels) {
+			for (int pathtracing = 0; pathtracing <= 1; pathtracing++) {
+				vector<double> load, build, render;
+				uint64_t rays = 0;
+				size_t accel_bytes = 0;
+				resetPeakMemory();
+				size_t start_bytes = run_peak ? peakMemoryBytes() : 0;
+
+				for (int r = 0; r < repeats; r++) {
+					auto t0 = chrono::high_resolution_clock::now();
+					load_scene(file.c_str());
+					config.spp = bench_spp;
+					config.accel = accel.accel;
+					config.grid_cells = accel.grid_cells;
+					config.builder = accel.builder;
+					config.accel_cache = false;	// the builds are timed
+					config.pathtracing = pathtracing != 0;
+					auto t1 = chrono::high_resolution_clock::now();
+					buildAccelStructure();
+					auto t2 = chrono::high_resolution_clock::now();
+					frame = 0;
+					render.push_back(renderImage());
+					rays = raysTraced;
+					accel_bytes = accelMemoryBytes();
+
+					load.push_back(chrono::duration<double>(t1 - t0).count());
+					build.push_back(chrono::duration<double>(t2 - t1).count());
+					delete(scene);
+					free(img_Data);
+				}
+
+				double render_s = median(render);
+				double accel_mb = accel_bytes / (1024.0 * 1024.0);
+				double peak_mb = (peakMemoryBytes() - start_bytes) / (1024.0 * 1024.0);
+				const char* integrator = pathtracing ? "pathtracing" : "raytracing";
+				int spp = config.antialiasing ? config.spp : 1;
+
+				char line[512];
+				snprintf(line, sizeof(line), "{\"scene\": \"%s\", \"accel\": \"%s\", \"integrator\": \"%s\", \"res_x\": %d, "
+					"\"res_y\": %d, \"spp\": %d, \"threads\": %d, \"repeats\": %d, \"load_s\": %.4f, \"build_s\": %.4f, "
+					"\"render_s\": %.4f, \"render_min_s\": %.4f, \"rays\": %llu, \"mrays_s\": %.3f, \"accel_mb\": %.1f, "
+					"\"%s\": %.1f}",
+					benchScenes[s], accel.name, integrator, RES_X, RES_Y, spp, num_threads, repeats, median(load),
+					median(build), render_s, *min_element(render.begin(), render.end()), (unsigned long long)rays,
+					rays / render_s / 1e6, accel_mb, peak_name, peak_mb);
+				printf("%s\n", line);
+
+				if (out != NULL) {
+					if (csv) {
+						fprintf(out, "%s,%s,%s,%d,%d,%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%llu,%.3f,%.1f,%.1f\n", benchScenes[s],
+							accel.name, integrator, RES_X, RES_Y, spp, num_threads, repeats, median(load), median(build),
+							render_s, *min_element(render.begin(), render.end()), (unsigned long long)rays, rays / render_s / 1e6,
+							accel_mb, peak_mb);
+					}
+					else fprintf(out, "%s\n", line);
+					fflush(out);
+				}
+			}
+		}
+	}
+
+	if (out != NULL) fclose(out);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[])
 {
 	//Initialization of DevIL 
@@ -1000,6 +1891,75 @@ int main(int argc, char* argv[])
 	}
 	ilInit();
 
+	// -threads N : number of render threads
+	// -<option> VALUE : render option (see RenderConfig), overrides the "opt" lines of the scene file.
+	//                   E.g. -spp 64 -accel grid -pathtracing off -dof off -max-depth 8
+	// -scene FILE [-output FILE] : headless render of the scene file (no window), saved to RT_Output.png by default
+	// -bench [N] [-bench-out FILE] : benchmark of the scenes, accelerators and integrators, N repeats of every run (3 by
+	//                                 default) at BENCH_SPP samples per pixel (or -spp). The results are also written to
+	//                                 FILE (CSV if it ends in .csv, else JSON lines)
+	// -sampler-bench [N] : prints the convergence of the samplers (RMSE against a reference with N samples per pixel)
+	// -kernel-bench [N] : times the intersection kernels on random rays and primitives (N tests per kernel, 16M by default)
+	// -resume : the progressive render continues from the last checkpoint
+	int bench_samples = 0;
+	int kernel_tests = 0;
+	const char* batch_scene = NULL;
+	const char* batch_output = "RT_Output.png";
+	int bench_repeats = 0;
+	const char* bench_output = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-scene") == 0 && i + 1 < argc) batch_scene = argv[++i];
+		else if (strcmp(argv[i], "-output") == 0 && i + 1 < argc) batch_output = argv[++i];
+		else if (strcmp(argv[i], "-resume") == 0) resumeRender = true;
+		else if (strcmp(argv[i], "-bench") == 0) {
+			bench_repeats = (i + 1 < argc && atoi(argv[i + 1]) > 0) ? atoi(argv[++i]) : 3;
+		}
+		else if (strcmp(argv[i], "-bench-out") == 0 && i + 1 < argc) bench_output = argv[++i];
+		else if (strcmp(argv[i], "-sampler-bench") == 0) {
+			bench_samples = (i + 1 < argc && atoi(argv[i + 1]) > 0) ? atoi(argv[++i]) : 1024;
+		}
+		else if (strcmp(argv[i], "-kernel-bench") == 0) {
+			kernel_tests = (i + 1 < argc && atoi(argv[i + 1]) > 0) ? atoi(argv[++i]) : 1 << 24;
+		}
+		else if (argv[i][0] == '-' && i + 1 < argc) {
+			// checked right away, so a typo fails before the scene is loaded
+			RenderConfig check;
+			if (!setOption(check, argv[i] + 1, argv[i + 1])) exit(EXIT_FAILURE);
+			cliOptions.push_back(make_pair(string(argv[i] + 1), string(argv[i + 1])));
+			i++;
+		}
+		else printf("Unknown argument %s\n", argv[i]);
+	}
+
+	if (num_threads <= 0) num_threads = thread::hardware_concurrency();
+	if (num_threads <= 0 || USE_MAIL) num_threads = 1; //mailboxes are shared by all the rays
+	printf("RENDER THREADS: %d\n", num_threads);
+
+	//the tiles (and the progressive passes) are written all over the image, so the drawing buffers must hold the full frame
+	if (num_threads > 1) draw_mode = 2;
+
+	if (batch_scene != NULL) {
+		drawModeEnabled = false;
+		exit(batchRender(batch_scene, batch_output));
+	}
+
+	if (bench_repeats > 0) {
+		drawModeEnabled = false;
+		exit(benchmark(bench_repeats, bench_output));
+	}
+
+	if (kernel_tests > 0) exit(kernelBenchmark(kernel_tests));
+
+	if (bench_samples > 0) {
+		init_scene();
+		buildAccelStructure();
+		samplerBenchmark(bench_samples);
+		delete(scene);
+		free(img_Data);
+		exit(EXIT_SUCCESS);
+	}
+
 	int ch;
 	if (!drawModeEnabled) {
 
@@ -1020,6 +1980,7 @@ int main(int argc, char* argv[])
 
 	else {   //Use OpenGL to draw image in the screen
 		init_scene();
+		if (config.progressive) draw_mode = 2;
 		if (draw_mode == 0) { // draw image point by point
 			size_vertices = 2 * sizeof(float);
 			size_colors = 3 * sizeof(float);
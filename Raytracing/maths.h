@@ -2,6 +2,7 @@
 #define __MATHS__
 
 #include <stdlib.h>
+#include <math.h>
 
 // prototypes
 
@@ -91,4 +92,22 @@ inline  float u8tofloat(uint8_t x)
 	return (float)(x / 255.99f);
 }
 
+// ---------------------------------------------------- running mean and variance (Welford)
+struct RunningStats {
+	int n = 0;
+	double mean = 0, m2 = 0;
+
+	void add(double x) {
+		n++;
+		double delta = x - mean;
+		mean += delta / n;
+		m2 += delta * (x - mean);
+	}
+
+	double variance() const { return n > 1 ? m2 / (n - 1) : 0; }
+
+	// standard error of the mean
+	double standardError() const { return n > 1 ? sqrt(variance() / n) : 0; }
+};
+
 #endif
@@ -0,0 +1,126 @@
+#include "platform.h"
+
+// windows.h stays out of the headers (its macros clash with the renderer's names)
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+
+size_t peakMemoryBytes(void)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize;
+}
+
+bool resetPeakMemory(void)
+{
+	return false;
+}
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	// the mapping keeps the file open
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return false;
+
+	view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == NULL) {
+		close();
+		return false;
+	}
+	length = (size_t)file_size.QuadPart;
+	return true;
+}
+
+void MappedFile::close(void)
+{
+	if (view != nullptr) UnmapViewOfFile(view);
+	if (mapping != nullptr) CloseHandle(mapping);
+	view = nullptr;
+	mapping = nullptr;
+	length = 0;
+}
+#else
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// VmHWM of /proc/self/status on Linux (resetPeakMemory can lower it), else the never decreasing ru_maxrss
+size_t peakMemoryBytes(void)
+{
+	FILE* status = fopen("/proc/self/status", "r");
+	if (status != NULL) {
+		char line[256];
+		unsigned long kb = 0;
+		bool found = false;
+		while (!found && fgets(line, sizeof(line), status) != NULL) found = sscanf(line, "VmHWM: %lu kB", &kb) == 1;
+		fclose(status);
+		if (found) return (size_t)kb * 1024;
+	}
+
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+	return (size_t)usage.ru_maxrss * 1024;	// kilobytes on Linux
+}
+
+bool resetPeakMemory(void)
+{
+#ifdef __GLIBC__
+	malloc_trim(0);	// the heap freed by the previous run would otherwise stay resident and count in the next peak
+#endif
+	FILE* clear_refs = fopen("/proc/self/clear_refs", "w");
+	if (clear_refs == NULL) return false;
+	bool ok = fputs("5", clear_refs) >= 0;	// 5: reset the peak resident set size
+	return (fclose(clear_refs) == 0) && ok;
+}
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	// the mapping stays valid after the descriptor is closed
+	void* address = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (address == MAP_FAILED) return false;
+
+	view = address;
+	length = (size_t)info.st_size;
+	return true;
+}
+
+void MappedFile::close(void)
+{
+	if (view != nullptr) munmap(view, length);
+	view = nullptr;
+	length = 0;
+}
+#endif
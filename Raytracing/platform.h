@@ -0,0 +1,69 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stddef.h>
+#include <utility>
+
+// Peak resident memory of the process so far (or since resetPeakMemory), in bytes (0 if unknown)
+size_t peakMemoryBytes(void);
+// Restarts the peak at the memory in use now. false if the platform can't (Windows): the peak is then the process's
+bool resetPeakMemory(void);
+
+// Read only memory map of a whole file: its pages are only read from the disk when used
+class MappedFile
+{
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	bool open(const char* filename);	// false if the file can't be mapped (or is empty)
+	void close(void);
+
+	void swap(MappedFile& other) {
+		std::swap(view, other.view);
+		std::swap(length, other.length);
+#ifdef _WIN32
+		std::swap(mapping, other.mapping);
+#endif
+	}
+
+	const unsigned char* data() const { return (const unsigned char*)view; }
+	size_t size() const { return length; }
+
+private:
+	void* view = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	void* mapping = nullptr;
+#endif
+};
+
+// The MSVC only functions used by the renderer, so it also builds on Linux (Makefile, headless render nodes)
+#ifdef _WIN32
+#include <conio.h>
+#else
+#include <stdio.h>
+#include <string.h>
+
+inline int _getch(void) { return getchar(); }
+
+inline int strcpy_s(char* dest, size_t size, const char* src)
+{
+	if (size == 0) return 1;
+	strncpy(dest, src, size - 1);
+	dest[size - 1] = '\0';
+	return 0;
+}
+
+inline int strcat_s(char* dest, size_t size, const char* src)
+{
+	size_t len = strlen(dest);
+	if (len + 1 >= size) return 1;
+	strncat(dest, src, size - len - 1);
+	return 0;
+}
+#endif
+
+#endif
@@ -6,6 +6,7 @@
 class Ray
 {
 public:
+	Ray() : i(0), j(0), id(0) {};
 	Ray(const Vector& o, const Vector& dir, int ix = 0, int jx = 0) : origin(o), direction(dir), i(ix), j(jx) {};
 
 	Vector origin;
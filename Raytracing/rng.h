@@ -0,0 +1,58 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// PCG32 random number generator (pcg-random.org): 16 bytes of state, no shared state between threads.
+// Every camera sample gets its own generator seeded from (pixel, sample, frame), so the random numbers of a
+// sample do not depend on which thread renders it nor on the order the pixels are rendered
+class RNG
+{
+public:
+	RNG(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) { setSeed(seed, stream); }
+
+	// Generator of the sample-th sample of a pixel (index in the image) in a given frame
+	static RNG forSample(uint32_t pixel, uint32_t sample, uint32_t frame) {
+		return RNG(mix(((uint64_t)frame << 32 | sample) ^ mix(pixel)), pixel);
+	}
+
+	void setSeed(uint64_t seed, uint64_t stream) {
+		state = 0;
+		inc = (stream << 1) | 1;
+		nextUInt();
+		state += seed;
+		nextUInt();
+	}
+
+	uint32_t nextUInt(void) {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+		uint32_t rot = (uint32_t)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	// Uniform in [0, 1[
+	float nextFloat(void) {
+		return (nextUInt() >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// Independent generator (e.g. for a path that splits in two)
+	RNG split(void) {
+		uint64_t seed = ((uint64_t)nextUInt() << 32) | nextUInt();
+		return RNG(seed, mix(inc));
+	}
+
+private:
+	uint64_t state, inc;
+
+	// splitmix64 finalizer, spreads nearby keys over the whole seed space
+	static uint64_t mix(uint64_t x) {
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+};
+
+#endif
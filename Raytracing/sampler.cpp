@@ -1,11 +1,394 @@
-#include "vector.h"
-#include "maths.h"
+#include <cmath>
+#include <vector>
 
-// Sampling with rejection method
-Vector sample_unit_disk(void) {
-	Vector p;
+#include "sampler.h"
+
+using namespace std;
+
+#define SAMPLER_PI 3.141592653589793238462f
+
+// Side of the (tileable) blue noise mask
+#define BLUE_NOISE_SIZE 64
+
+// Dimensions skipped by the second half of a split path
+#define SPLIT_DIMENSIONS 1024
+
+static const int HALTON_PRIMES[] = {
+	2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+	59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+static const int HALTON_DIMENSIONS = sizeof(HALTON_PRIMES) / sizeof(HALTON_PRIMES[0]);
+
+#pragma region HELPERS
+
+// 32 bit integer hash (lowbias32)
+static inline uint32_t hash32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline uint32_t hash32(uint32_t a, uint32_t b)
+{
+	return hash32(a ^ (hash32(b) + 0x9e3779b9U + (a << 6) + (a >> 2)));
+}
+
+static inline uint32_t hash32(uint32_t a, uint32_t b, uint32_t c)
+{
+	return hash32(hash32(a, b), c);
+}
+
+// [0, 1[ from the 24 high bits
+static inline float toFloat(uint32_t x)
+{
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+static inline uint32_t reverseBits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+	x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+	x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+	x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+	return x;
+}
+
+// Random permutation of [0, n[ without tables (Kensler, "Correlated Multi-Jittered Sampling")
+static uint32_t permute(uint32_t i, uint32_t n, uint32_t seed)
+{
+	uint32_t w = n - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
 	do {
-		p = Vector(rand_float(), rand_float(), 0.0) * 2 - Vector(1.0, 1.0, 0.0);
-	} while (p*p >= 1.0);
-	return p;
-}
\ No newline at end of file
+		i ^= seed; i *= 0xe170893dU;
+		i ^= seed >> 16;
+		i ^= (i & w) >> 4;
+		i ^= seed >> 8; i *= 0x0929eb3fU;
+		i ^= seed >> 23;
+		i ^= (i & w) >> 1; i *= 1 | seed >> 27;
+		i *= 0x6935fa69U;
+		i ^= (i & w) >> 11; i *= 0x74dcb303U;
+		i ^= (i & w) >> 2; i *= 0x9e501cc3U;
+		i ^= (i & w) >> 2; i *= 0xc860a3dfU;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= n);
+	return (i + seed) % n;
+}
+
+// Owen scrambling of the bits of x (Burley, "Practical Hash-based Owen Scrambling")
+static inline uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cU;
+	x ^= x * 0xb82f1e52U;
+	x ^= x * 0xc7afe638U;
+	x ^= x * 0x8d22f6e6U;
+	return reverseBits(x);
+}
+
+// First two dimensions of the Sobol sequence (as 0.32 fixed point)
+static inline uint32_t sobol0(uint32_t i)
+{
+	return reverseBits(i);
+}
+
+// The second dimension is linear (over GF(2)) in the bits of the index, so it is tabulated one byte at a time
+struct Sobol1Table {
+	uint32_t bytes[4][256];
+
+	Sobol1Table() {
+		uint32_t columns[32];
+		uint32_t v = 1U << 31;
+		for (int bit = 0; bit < 32; bit++, v ^= v >> 1) columns[bit] = v;
+
+		for (int b = 0; b < 4; b++) {
+			for (int i = 0; i < 256; i++) {
+				uint32_t r = 0;
+				for (int bit = 0; bit < 8; bit++) {
+					if (i & (1 << bit)) r ^= columns[8 * b + bit];
+				}
+				bytes[b][i] = r;
+			}
+		}
+	}
+};
+
+static const Sobol1Table sobol1_table;
+
+static inline uint32_t sobol1(uint32_t i)
+{
+	return sobol1_table.bytes[0][i & 0xff] ^ sobol1_table.bytes[1][(i >> 8) & 0xff] ^
+		sobol1_table.bytes[2][(i >> 16) & 0xff] ^ sobol1_table.bytes[3][i >> 24];
+}
+
+static double radicalInverse(int base, uint32_t i)
+{
+	double inv_base = 1.0 / base, f = inv_base, r = 0;
+	while (i > 0) {
+		r += f * (i % base);
+		i /= base;
+		f *= inv_base;
+	}
+	return r;
+}
+
+// Ranks (in [0, 1[) of a tileable blue noise mask made with the void and cluster method (Ulichney 1993)
+static vector<float> makeBlueNoise(void)
+{
+	const int size = BLUE_NOISE_SIZE, mask = BLUE_NOISE_SIZE - 1, n = size * size;
+	const float sigma = 1.5f;
+
+	// gaussian energy that a point adds at each (toroidal) offset
+	vector<float> kernel(n);
+	for (int dy = 0; dy < size; dy++) {
+		for (int dx = 0; dx < size; dx++) {
+			float x = (float)(dx < size - dx ? dx : size - dx);
+			float y = (float)(dy < size - dy ? dy : size - dy);
+			kernel[dy * size + dx] = exp(-(x * x + y * y) / (2 * sigma * sigma));
+		}
+	}
+
+	vector<char> pattern(n, 0);
+	vector<float> energy(n, 0.0f);
+
+	auto toggle = [&](int p, bool on) {
+		pattern[p] = on;
+		float sign = on ? 1.0f : -1.0f;
+		int px = p % size, py = p / size;
+		for (int q = 0; q < n; q++) {
+			energy[q] += sign * kernel[(((q / size) - py) & mask) * size + (((q % size) - px) & mask)];
+		}
+	};
+	// tightest cluster (set point with most energy) or largest void (empty point with least energy)
+	auto find = [&](bool cluster) {
+		int best = -1;
+		for (int p = 0; p < n; p++) {
+			if (pattern[p] != cluster) continue;
+			if (best < 0 || (cluster ? energy[p] > energy[best] : energy[p] < energy[best])) best = p;
+		}
+		return best;
+	};
+
+	// initial pattern: 10% of the points at random, relaxed by moving clusters to voids
+	RNG rng(BLUE_NOISE_SIZE);
+	int ones = n / 10;
+	for (int count = 0; count < ones; ) {
+		int p = rng.nextUInt() % n;
+		if (!pattern[p]) {
+			toggle(p, true);
+			count++;
+		}
+	}
+
+	for (int iter = 0; iter < n; iter++) {
+		int cluster = find(true);
+		toggle(cluster, false);
+		int gap = find(false);
+		toggle(gap, true);
+		if (gap == cluster) break;
+	}
+
+	vector<char> initial_pattern = pattern;
+	vector<float> initial_energy = energy;
+	vector<int> rank(n);
+
+	// the initial points are ranked by removing the tightest clusters first
+	for (int r = ones - 1; r >= 0; r--) {
+		int cluster = find(true);
+		toggle(cluster, false);
+		rank[cluster] = r;
+	}
+
+	// the remaining ones by filling the largest voids
+	pattern = initial_pattern;
+	energy = initial_energy;
+	for (int r = ones; r < n; r++) {
+		int gap = find(false);
+		toggle(gap, true);
+		rank[gap] = r;
+	}
+
+	vector<float> ranks(n);
+	for (int p = 0; p < n; p++) ranks[p] = (rank[p] + 0.5f) / n;
+	return ranks;
+}
+
+static const vector<float>& blueNoiseMask(void)
+{
+	static const vector<float> mask = makeBlueNoise(); // built once, on first use
+	return mask;
+}
+
+#pragma endregion HELPERS
+
+Vector sample_unit_disk(float u, float v)
+{
+	float a = 2 * u - 1;
+	float b = 2 * v - 1;
+
+	if (a == 0 && b == 0) return Vector(0, 0, 0);
+
+	float r, phi;
+	if (a * a > b * b) {
+		r = a;
+		phi = (SAMPLER_PI / 4) * (b / a);
+	}
+	else {
+		r = b;
+		phi = (SAMPLER_PI / 2) - (SAMPLER_PI / 4) * (a / b);
+	}
+	return Vector(r * cos(phi), r * sin(phi), 0);
+}
+
+void Sampler::startSample(int x, int y, int index)
+{
+	this->x = x;
+	this->y = y;
+	this->index = index;
+	dimension = 0;
+	rng = RNG::forSample((uint32_t)y << 16 | (uint32_t)x, index, frame);
+}
+
+float Sampler::get1D(void)
+{
+	int dim = dimension++;
+
+	switch (type) {
+	case sampler_type::Stratified:
+		return stratified1D(dim);
+
+	case sampler_type::Halton:
+		if (dim < HALTON_DIMENSIONS) return halton(dim);
+		break;
+
+	case sampler_type::Sobol:
+	case sampler_type::BlueNoise: {
+		float u, v;
+		sobol2D(dim, type == sampler_type::Sobol ? hash32(x, y) : 0, u, v);
+		if (type == sampler_type::BlueNoise) blueNoiseShift(dim, u, v);
+		return u;
+	}
+
+	default:
+		break;
+	}
+	return rng.nextFloat();
+}
+
+void Sampler::get2D(float& u, float& v)
+{
+	int dim = dimension;
+	dimension += 2;
+
+	switch (type) {
+	case sampler_type::Stratified:
+		stratified2D(dim, u, v);
+		return;
+
+	case sampler_type::Halton:
+		if (dim + 1 < HALTON_DIMENSIONS) {
+			u = halton(dim);
+			v = halton(dim + 1);
+			return;
+		}
+		break;
+
+	case sampler_type::Sobol:
+		sobol2D(dim, hash32(x, y), u, v);
+		return;
+
+	case sampler_type::BlueNoise:
+		sobol2D(dim, 0, u, v);
+		blueNoiseShift(dim, u, v);
+		return;
+
+	default:
+		break;
+	}
+	u = rng.nextFloat();
+	v = rng.nextFloat();
+}
+
+Sampler Sampler::split(void)
+{
+	Sampler other = *this;
+	other.rng = rng.split();
+	other.dimension += SPLIT_DIMENSIONS;
+	return other;
+}
+
+const char* Sampler::name(sampler_type type)
+{
+	switch (type) {
+	case sampler_type::Random: return "Random";
+	case sampler_type::Stratified: return "Stratified";
+	case sampler_type::Halton: return "Halton";
+	case sampler_type::Sobol: return "Sobol";
+	case sampler_type::BlueNoise: return "BlueNoise";
+	}
+	return "?";
+}
+
+// The n samples of a pixel fall one in each of n strata, shuffled differently in every dimension
+float Sampler::stratified1D(int dim)
+{
+	uint32_t stratum = permute(index, spp, hash32(x, y, hash32(dim, frame)));
+	return (stratum + rng.nextFloat()) / spp;
+}
+
+void Sampler::stratified2D(int dim, float& u, float& v)
+{
+	int side = (int)sqrt((float)spp);
+
+	if (side * side == spp) {
+		uint32_t stratum = permute(index, spp, hash32(x, y, hash32(dim, frame)));
+		u = (stratum % side + rng.nextFloat()) / side;
+		v = (stratum / side + rng.nextFloat()) / side;
+	}
+	else {
+		// latin hypercube: n strata in each axis
+		u = stratified1D(dim);
+		v = stratified1D(dim + 1);
+	}
+}
+
+// Consecutive frames continue the sequence. The sequence is shifted by a random offset per pixel
+// (Cranley-Patterson rotation), otherwise all the pixels would have the same error
+float Sampler::halton(int dim)
+{
+	double value = radicalInverse(HALTON_PRIMES[dim], frame * spp + index) + toFloat(hash32(x, y, dim));
+	return (float)(value - floor(value));
+}
+
+// Every 2D pair is the (0,2) sequence made by the first two Sobol dimensions, with its own shuffled order of the
+// points and Owen scrambling, so the pairs are decorrelated from each other ("padding")
+void Sampler::sobol2D(int dim, uint32_t seed, float& u, float& v)
+{
+	uint32_t dim_seed = hash32(seed, dim);
+	uint32_t i = owenScramble(frame * spp + index, dim_seed);
+
+	u = toFloat(owenScramble(sobol0(i), hash32(dim_seed, 1)));
+	v = toFloat(owenScramble(sobol1(i), hash32(dim_seed, 2)));
+}
+
+// Toroidal shift of the sample by the blue noise mask, read at a different offset for every dimension
+void Sampler::blueNoiseShift(int dim, float& u, float& v)
+{
+	const vector<float>& mask = blueNoiseMask();
+	const int m = BLUE_NOISE_SIZE - 1;
+
+	u += mask[((y + 41 * dim + 7) & m) * BLUE_NOISE_SIZE + ((x + 23 * dim + 11) & m)];
+	v += mask[((y + 41 * dim + 29) & m) * BLUE_NOISE_SIZE + ((x + 23 * dim + 37) & m)];
+	if (u >= 1) u -= 1;
+	if (v >= 1) v -= 1;
+}
@@ -1,3 +1,61 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+
 #include "vector.h"
+#include "rng.h"
+
+enum sampler_type { Random, Stratified, Halton, Sobol, BlueNoise };
+
+// Maps a uniform sample of the unit square to the unit disk (concentric mapping, keeps the stratification)
+Vector sample_unit_disk(float u, float v);
+
+// Sample values of one camera sample (pixel, index). Every call hands out the next dimension(s) of the sample,
+// so the integrators must ask for them in the same order:
+//   pixel (2D), lens (2D), then at every bounce: russian roulette (1D), BSDF direction (2D), one 2D per light
+//   and the dielectric reflection/refraction choice (1D).
+//   Random     -> independent random numbers (PCG32)
+//   Stratified -> jittered strata (sqrt(n) x sqrt(n) grid, latin hypercube when n is not a square),
+//                 strata shuffled independently in every dimension
+//   Halton     -> Halton sequence (a prime base per dimension, 32 dimensions), randomly shifted per pixel
+//   Sobol      -> Owen scrambled Sobol (0,2) sequence, every 2D pair padded with its own shuffle and scramble
+//   BlueNoise  -> the same Sobol sequence in every pixel, shifted per pixel by a blue noise mask, so the error
+//                 is spread as blue noise over the image
+// The dimensions the sequences don't cover use the random generator of the sample.
+// Plain value type (no allocation), cheap to copy along with the path it belongs to
+class Sampler
+{
+public:
+	Sampler() : type(sampler_type::Random), spp(1), frame(0), x(0), y(0), index(0), dimension(0) {}
+	Sampler(sampler_type type, int samples_per_pixel, unsigned int frame)
+		: type(type), spp(samples_per_pixel), frame(frame), x(0), y(0), index(0), dimension(0) {}
+
+	// Starts the index-th sample (0 <= index < samples_per_pixel) of pixel (x, y)
+	void startSample(int x, int y, int index);
+
+	float get1D(void);
+	void get2D(float& u, float& v);
+
+	// Copy continuing with dimensions of its own (for a path that splits in two)
+	Sampler split(void);
+
+	sampler_type getType(void) const { return type; }
+	static const char* name(sampler_type type);
+
+private:
+	sampler_type type;
+	int spp;
+	unsigned int frame;
+	int x, y, index;
+	int dimension;
+	RNG rng;
+
+	float stratified1D(int dim);
+	void stratified2D(int dim, float& u, float& v);
+	float halton(int dim);
+	void sobol2D(int dim, uint32_t seed, float& u, float& v);
+	void blueNoiseShift(int dim, float& u, float& v);
+};
 
-Vector sample_unit_disk(void);
\ No newline at end of file
+#endif
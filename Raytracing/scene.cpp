@@ -1,10 +1,16 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <float.h>
 #include <IL/il.h>
 
 #include "maths.h"
 #include "scene.h"
+#include "instance.h"
+#include "platform.h"
+#include "stats.h"
 
 
 // ======== TRIANGLE METHODS ========
@@ -38,6 +44,70 @@ AABB Triangle::GetBoundingBox() {
 	return(AABB(Min, Max));
 }
 
+// Bounds of the polygon left after clipping the triangle by the 6 planes of the box (Sutherland-Hodgman),
+// enlarged like the bounding box but kept inside the box
+bool Triangle::GetClippedBoundingBox(const AABB& box, AABB& clipped)
+{
+	float lo[3] = { box.min.x, box.min.y, box.min.z }, hi[3] = { box.max.x, box.max.y, box.max.z };
+	float buffers[2][9][3];	// every plane adds at most one vertex
+	float (*poly)[3] = buffers[0], (*next)[3] = buffers[1];
+	int n = 3;
+
+	for (int v = 0; v < 3; v++) {
+		poly[v][0] = points[v].x; poly[v][1] = points[v].y; poly[v][2] = points[v].z;
+	}
+
+	for (int plane = 0; plane < 6 && n > 0; plane++) {
+		int axis = plane >> 1;
+		float bound = (plane & 1) ? hi[axis] : lo[axis];
+		float side = (plane & 1) ? -1.0f : 1.0f;	// inside: side * (p - bound) >= 0
+
+		int outside = 0;
+		for (int v = 0; v < n; v++) outside += side * (poly[v][axis] - bound) < 0;
+		if (outside == 0) continue;	// the usual case: the plane doesn't cut the polygon
+
+		int m = 0;
+		for (int v = 0; v < n; v++) {
+			const float* a = poly[v];
+			const float* b = poly[(v + 1) % n];
+			float da = side * (a[axis] - bound), db = side * (b[axis] - bound);
+
+			if (da >= 0) {
+				for (int k = 0; k < 3; k++) next[m][k] = a[k];
+				m++;
+			}
+			if ((da >= 0) != (db >= 0)) {
+				float t = da / (da - db);
+				for (int k = 0; k < 3; k++) next[m][k] = a[k] + (b[k] - a[k]) * t;
+				next[m][axis] = bound;
+				m++;
+			}
+		}
+
+		n = m;
+		swap(poly, next);
+	}
+
+	if (n == 0) {
+		clipped = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		return true;
+	}
+
+	float p_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, p_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (int v = 0; v < n; v++) {
+		for (int k = 0; k < 3; k++) {
+			p_min[k] = min(p_min[k], poly[v][k]);
+			p_max[k] = max(p_max[k], poly[v][k]);
+		}
+	}
+	for (int k = 0; k < 3; k++) {
+		p_min[k] = max(p_min[k] - EPSILON, lo[k]);
+		p_max[k] = min(p_max[k] + EPSILON, hi[k]);
+	}
+	clipped = AABB(Vector(p_min[0], p_min[1], p_min[2]), Vector(p_max[0], p_max[1], p_max[2]));
+	return true;
+}
+
 Vector Triangle::getNormal(Vector point)
 {
 	return normal;
@@ -49,6 +119,7 @@ bool Triangle::intercepts(Ray& ray, float& time) {
 		if (mailbox >= ray.id) return false;
 		mailbox = ray.id;
 	}
+	STAT(TriangleTests, 1);
 
 	Vector P0 = points[0], P1 = points[1], P2 = points[2];
 
@@ -119,6 +190,7 @@ bool Plane::intercepts(Ray& r, float& t)
 		if (mailbox >= r.id) return false;
 		mailbox = r.id;
 	}
+	STAT(PlaneTests, 1);
 
 	float numer = (r.origin - A) * PN;
 	float divid = PN * r.direction;
@@ -152,6 +224,7 @@ bool Sphere::intercepts(Ray& r, float& t)
 		if (mailbox >= r.id) return false;
 		mailbox = r.id;
 	}
+	STAT(SphereTests, 1);
 
 	Vector Rd = r.getDirection();
 
@@ -218,6 +291,7 @@ bool aaBox::intercepts(Ray& ray, float& t)
 		if (mailbox >= ray.id) return false;
 		mailbox = ray.id;
 	}
+	STAT(BoxTests, 1);
 
 	if (this->GetBoundingBox().intercepts(ray, t)) {
 		return true;
@@ -285,6 +359,7 @@ Scene::~Scene()
 	}
 	objects.erase();
 	*/
+	for (Prototype* prototype : prototypes) delete prototype;
 }
 
 int Scene::getNumObjects()
@@ -292,12 +367,47 @@ int Scene::getNumObjects()
 	return objects.size();
 }
 
+// FNV-1a over the type and the parameters of an object
+void Scene::hashGeometry(uint64_t& hash, char type, const float* values, int n)
+{
+	hash ^= (unsigned char)type;
+	hash *= 0x100000001b3ULL;
+
+	const unsigned char* bytes = (const unsigned char*)values;
+	for (size_t i = 0; i < n * sizeof(float); i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+}
+
+uint64_t Scene::getGeometryHash()
+{
+	// the instances may have moved since loading
+	uint64_t hash = geometry_hash;
+	for (Instance* instance : instances) hashGeometry(hash, 't', instance->getTransform().getMatrix(), 12);
+	return hash;
+}
+
 
 void Scene::addObject(Object* o)
 {
 	objects.push_back(o);
 }
 
+void Scene::addGeometry(Object* o, Prototype* prototype)
+{
+	if (prototype != NULL) prototype->addObject(o);
+	else addObject(o);
+}
+
+Prototype* Scene::findPrototype(const string& name)
+{
+	for (Prototype* prototype : prototypes) {
+		if (prototype->getName() == name) return prototype;
+	}
+	return NULL;
+}
+
 
 Object* Scene::getObject(unsigned int index)
 {
@@ -476,6 +586,7 @@ bool Scene::load_p3f(const char* name)
 	char		token[256];
 	ifstream	file(name, ios::in);
 	Material* material;
+	Prototype* prototype = NULL;	// being defined: the objects are its geometry
 
 	material = NULL;
 
@@ -489,7 +600,12 @@ bool Scene::load_p3f(const char* name)
 				double Kd, Ks, Shine, T, ior;
 				Color cd, cs, em;
 
-				file >> cd >> Kd >> cs >> Ks >> Shine >> T >> ior >> em;
+				// the emission is optional (the older scenes don't have it)
+				string line;
+				getline(file, line);
+				istringstream values(line);
+				values >> cd >> Kd >> cs >> Ks >> Shine >> T >> ior;
+				if (!(values >> em)) em = Color();
 
 				material = new Material(cd, Kd, cs, Ks, Shine, T, ior, em);
 			}
@@ -501,9 +617,11 @@ bool Scene::load_p3f(const char* name)
 				Sphere* sphere;
 
 				file >> center >> radius;
+				float values[] = { center.x, center.y, center.z, radius };
+				hashGeometry(geometry_hash, 's', values, 4);
 				sphere = new Sphere(center, radius);
 				if (material) sphere->SetMaterial(material);
-				this->addObject((Object*)sphere);
+				this->addGeometry((Object*)sphere, prototype);
 			}
 
 			else if (cmd == "box")    //axis aligned box
@@ -512,9 +630,11 @@ bool Scene::load_p3f(const char* name)
 				aaBox* box;
 
 				file >> minpoint >> maxpoint;
+				float values[] = { minpoint.x, minpoint.y, minpoint.z, maxpoint.x, maxpoint.y, maxpoint.z };
+				hashGeometry(geometry_hash, 'b', values, 6);
 				box = new aaBox(minpoint, maxpoint);
 				if (material) box->SetMaterial(material);
-				this->addObject((Object*)box);
+				this->addGeometry((Object*)box, prototype);
 			}
 			else if (cmd == "p")  // Polygon: just accepts triangles for now
 			{
@@ -526,9 +646,11 @@ bool Scene::load_p3f(const char* name)
 				if (total_vertices == 3)
 				{
 					file >> P0 >> P1 >> P2;
+					float values[] = { P0.x, P0.y, P0.z, P1.x, P1.y, P1.z, P2.x, P2.y, P2.z };
+					hashGeometry(geometry_hash, 'p', values, 9);
 					triangle = new Triangle(P0, P1, P2);
 					if (material) triangle->SetMaterial(material);
-					this->addObject((Object*)triangle);
+					this->addGeometry((Object*)triangle, prototype);
 				}
 				else
 				{
@@ -543,9 +665,11 @@ bool Scene::load_p3f(const char* name)
 				Plane* plane;
 
 				file >> P0 >> P1 >> P2;
+				float values[] = { P0.x, P0.y, P0.z, P1.x, P1.y, P1.z, P2.x, P2.y, P2.z };
+				hashGeometry(geometry_hash, 'l', values, 9);
 				plane = new Plane(P0, P1, P2);
 				if (material) plane->SetMaterial(material);
-				this->addObject((Object*)plane);
+				this->addGeometry((Object*)plane, prototype);
 			}
 
 			else if (cmd == "l")  // Need to check light color since by default is white
@@ -609,6 +733,58 @@ bool Scene::load_p3f(const char* name)
 				this->LoadSkybox(token);
 				this->SetSkyBoxFlg(true);
 			}
+			else if (cmd == "proto")  // Prototype: the objects up to "end" are its geometry, placed by "inst" lines
+			{
+				file >> token;
+				if (prototype != NULL || findPrototype(token) != NULL) {
+					cerr << "prototype '" << token << "' nested or defined twice.\n";
+					break;
+				}
+				prototype = new Prototype(token);
+				prototypes.push_back(prototype);
+				hashGeometry(geometry_hash, '{', NULL, 0);
+			}
+			else if (cmd == "end")
+			{
+				if (prototype == NULL) {
+					cerr << "'end' without 'proto'.\n";
+					break;
+				}
+				prototype = NULL;
+				hashGeometry(geometry_hash, '}', NULL, 0);
+			}
+			else if (cmd == "inst")  // Instance: prototype name and the 3x4 matrix (rows) of its transform
+			{
+				float matrix[12];
+				Transform transform;
+
+				file >> token;
+				for (int k = 0; k < 12; k++) file >> matrix[k];
+
+				Prototype* placed = findPrototype(token);
+				if (prototype != NULL || placed == NULL || placed->getNumObjects() == 0) {
+					cerr << "instance of an unknown or empty prototype '" << token << "' (or inside a prototype).\n";
+					break;
+				}
+				if (!transform.set(matrix)) {
+					cerr << "singular transform of an instance of '" << token << "'.\n";
+					break;
+				}
+
+				// which prototype (the transform is hashed by getGeometryHash)
+				float index = (float)(find(prototypes.begin(), prototypes.end(), placed) - prototypes.begin());
+				hashGeometry(geometry_hash, 'i', &index, 1);
+
+				Instance* instance = new Instance(placed, transform);
+				instances.push_back(instance);
+				this->addObject((Object*)instance);
+			}
+			else if (cmd == "opt")  // Render option
+			{
+				string option, value;
+				file >> option >> value;
+				options.push_back(make_pair(option, value));
+			}
 			else if (cmd[0] == '#')
 			{
 				file.ignore(lineSize, '\n');
@@ -624,5 +800,6 @@ bool Scene::load_p3f(const char* name)
 	}
 
 	file.close();
+	if (prototype != NULL) cerr << "prototype '" << prototype->getName() << "' without 'end'.\n";
 	return true;
 };
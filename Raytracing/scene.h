@@ -3,6 +3,8 @@
 
 #include <vector>
 #include <cmath>
+#include <string>
+#include <utility>
 #include <IL/il.h>
 using namespace std;
 
@@ -89,7 +91,12 @@ public:
 	virtual bool intercepts( Ray& r, float& dist ) = 0;
 	virtual Vector getNormal( Vector point ) = 0;
 	virtual AABB GetBoundingBox() = 0;
+	// Bounds of the part of the object inside box (inverted if none), for the spatial splits of the BVH builder.
+	// false if the object can't be clipped (the default): its BVH references are never split
+	virtual bool GetClippedBoundingBox(const AABB& box, AABB& clipped) { return false; }
 	virtual Vector getCentroid(void) = 0;
+	// Instance of a prototype (instance.h): its hits are shaded as the object of the prototype that was hit
+	virtual bool isInstance(void) { return false; }
 
 protected:
 	Material* m_Material;
@@ -98,6 +105,13 @@ protected:
 	
 };
 
+// Closest intersection of a ray with the scene
+struct HitRecord {
+	Object* obj;	// NULL -> no intersection
+	Vector point;
+	float t;
+};
+
 class Plane : public Object
 {
 protected:
@@ -125,6 +139,7 @@ public:
 	};
 	Vector getNormal(Vector point);
 	AABB GetBoundingBox(void);
+	bool GetClippedBoundingBox(const AABB& box, AABB& clipped);
 	
 protected:
 	Vector points[3];
@@ -179,6 +194,9 @@ private:
 };
 
 
+class Prototype;
+class Instance;
+
 class Scene
 {
 public:
@@ -205,6 +223,19 @@ public:
 	void setLights(vector<Light*> new_lights) { lights = new_lights; }
 
 	bool load_p3f(const char *name);  //Load NFF file method
+
+	// prototypes ("proto" blocks) of the scene file, placed by the instances among the objects
+	int getNumPrototypes() { return prototypes.size(); }
+	Prototype* getPrototype(int index) { return prototypes[index]; }
+	int getNumInstances() { return instances.size(); }
+	Instance* getInstance(int index) { return instances[index]; }
+
+	// hash of the objects of the scene (type and parameters, in file order, and where the instances are now):
+	// the camera, lights and materials don't change it, so it keys the caches of the acceleration structures
+	uint64_t getGeometryHash();
+
+	// render options of the scene file ("opt <name> <value>" lines), in file order
+	const vector<pair<string, string>>& getOptions() { return options; }
 	
 private:
 	vector<Object *> objects;
@@ -215,6 +246,16 @@ private:
 
 	bool SkyBoxFlg = false;
 
+	vector<pair<string, string>> options;
+
+	vector<Prototype *> prototypes;
+	vector<Instance *> instances;
+	Prototype* findPrototype(const string& name);
+	void addGeometry(Object* o, Prototype* prototype);	// to the prototype being defined, if any
+
+	uint64_t geometry_hash = 0xcbf29ce484222325ULL;	// as loaded
+	static void hashGeometry(uint64_t& hash, char type, const float* values, int n);
+
 	struct {
 		ILubyte *img;
 		unsigned int resX;
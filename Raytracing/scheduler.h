@@ -0,0 +1,121 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+using namespace std;
+
+// Rectangular block of pixels [x0, x1[ x [y0, y1[
+struct Tile {
+	int x0, y0, x1, y1;
+};
+
+// Hands out the tiles of an image to a pool of workers.
+// Each worker owns a queue with a contiguous block of tiles which it consumes from the front,
+// when it runs dry it steals from the back of the other workers' queues (work stealing)
+class TileScheduler
+{
+public:
+	TileScheduler(int res_x, int res_y, int tile_size, int n_workers) : queues(n_workers)
+	{
+		vector<Tile> tiles;
+
+		for (int y = 0; y < res_y; y += tile_size) {
+			for (int x = 0; x < res_x; x += tile_size) {
+				Tile tile;
+				tile.x0 = x;
+				tile.y0 = y;
+				tile.x1 = (x + tile_size < res_x) ? x + tile_size : res_x;
+				tile.y1 = (y + tile_size < res_y) ? y + tile_size : res_y;
+				tiles.push_back(tile);
+			}
+		}
+
+		// split the tiles in contiguous blocks (one per worker)
+		int n_tiles = tiles.size();
+		for (int w = 0; w < n_workers; w++) {
+			int first = (int)((long long)n_tiles * w / n_workers);
+			int last = (int)((long long)n_tiles * (w + 1) / n_workers);
+
+			for (int t = first; t < last; t++) {
+				queues[w].tiles.push_back(tiles[t]);
+			}
+		}
+
+		remaining = n_tiles;
+	}
+
+	// Gets the next tile for a worker. Returns false when there is no work left anywhere
+	bool next(int worker, Tile& tile)
+	{
+		int n_workers = queues.size();
+
+		// own work first (front of the queue)
+		if (pop(queues[worker], tile, true)) return true;
+
+		// steal from the others (back of their queues)
+		for (int i = 1; i < n_workers; i++) {
+			if (pop(queues[(worker + i) % n_workers], tile, false)) return true;
+		}
+
+		return false;
+	}
+
+	// Called by a worker once it has finished rendering a tile
+	void done() { remaining--; }
+
+	// Same, publishing the tile for takeFinished: its pixels are complete and the worker doesn't touch them again
+	void done(const Tile& tile)
+	{
+		{
+			lock_guard<mutex> guard(finished_lock);
+			finished_tiles.push_back(tile);
+		}
+		remaining--;
+	}
+
+	// Moves the tiles published since the last call to tiles. Everything the workers wrote to them before
+	// publishing is visible to the caller
+	void takeFinished(vector<Tile>& tiles)
+	{
+		lock_guard<mutex> guard(finished_lock);
+		tiles.insert(tiles.end(), finished_tiles.begin(), finished_tiles.end());
+		finished_tiles.clear();
+	}
+
+	bool finished() { return remaining <= 0; }
+
+private:
+	struct WorkQueue {
+		mutex lock;
+		deque<Tile> tiles;
+	};
+
+	vector<WorkQueue> queues;
+	atomic<int> remaining;
+
+	mutex finished_lock;
+	vector<Tile> finished_tiles;
+
+	bool pop(WorkQueue& queue, Tile& tile, bool front)
+	{
+		lock_guard<mutex> guard(queue.lock);
+
+		if (queue.tiles.empty()) return false;
+
+		if (front) {
+			tile = queue.tiles.front();
+			queue.tiles.pop_front();
+		}
+		else {
+			tile = queue.tiles.back();
+			queue.tiles.pop_back();
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include <stdio.h>
+
+#include "stats.h"
+
+void RenderStats::clear(void)
+{
+	for (int i = 0; i < N_STATS; i++) count[i] = 0;
+}
+
+void RenderStats::add(const RenderStats& other)
+{
+	for (int i = 0; i < N_STATS; i++) count[i] += other.count[i];
+}
+
+void RenderStats::print(double seconds) const
+{
+	uint64_t rays = count[PrimaryRays] + count[ShadowRays] + count[SecondaryRays];
+	uint64_t tests = count[TriangleTests] + count[SphereTests] + count[BoxTests] + count[PlaneTests];
+	double per_ray = rays > 0 ? 1.0 / rays : 0.0;
+
+	printf("RENDER STATS\n");
+	for (int i = 0; i < N_STATS; i++) {
+		printf("  %-16s %14llu\n", name((stat_counter)i), (unsigned long long)count[i]);
+	}
+	printf("  %-16s %14llu (%.2f Mrays/s)\n", "rays", (unsigned long long)rays, seconds > 0 ? rays / seconds / 1e6 : 0.0);
+	printf("  per ray: %.2f BVH nodes, %.2f grid cells, %.2f primitive tests\n",
+		count[BvhNodes] * per_ray, count[GridCells] * per_ray, tests * per_ray);
+}
+
+const char* RenderStats::name(stat_counter counter)
+{
+	switch (counter) {
+	case PrimaryRays: return "primary rays";
+	case ShadowRays: return "shadow rays";
+	case SecondaryRays: return "secondary rays";
+	case BvhNodes: return "BVH nodes";
+	case GridCells: return "grid cells";
+	case TriangleTests: return "triangle tests";
+	case SphereTests: return "sphere tests";
+	case BoxTests: return "box tests";
+	case PlaneTests: return "plane tests";
+	case InstanceTests: return "instance tests";
+	case Hits: return "hits";
+	case RouletteKills: return "roulette kills";
+	default: return "?";
+	}
+}
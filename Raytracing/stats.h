@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Render statistics: every thread counts in counters of its own (STAT), which the render adds up and reports at
+// the end. Opt in (define RENDER_STATS as 1, e.g. -DRENDER_STATS=1), otherwise STAT compiles to nothing
+#ifndef RENDER_STATS
+#define RENDER_STATS 0
+#endif
+
+enum stat_counter {
+	PrimaryRays, ShadowRays, SecondaryRays,
+	BvhNodes, GridCells,
+	TriangleTests, SphereTests, BoxTests, PlaneTests,
+	InstanceTests,		// rays moved into the prototype of an instance (its objects count as primitive tests)
+	Hits,				// closest hit rays that hit an object
+	RouletteKills,		// paths terminated by russian roulette
+	N_STATS
+};
+
+struct RenderStats {
+	uint64_t count[N_STATS];
+
+	RenderStats() { clear(); }
+
+	void clear(void);
+	void add(const RenderStats& other);
+
+	// Counters, and per ray averages of the traversal and intersection work
+	void print(double seconds) const;
+
+	static const char* name(stat_counter counter);
+};
+
+#if RENDER_STATS
+// Counters of the calling thread
+inline RenderStats& threadStats(void)
+{
+	static thread_local RenderStats stats;
+	return stats;
+}
+
+#define STAT(counter, n) (threadStats().count[counter] += (n))
+#else
+#define STAT(counter, n) ((void)0)
+#endif
+
+#endif
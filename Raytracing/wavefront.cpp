@@ -0,0 +1,327 @@
+#include <cmath>
+
+#include "wavefront.h"
+#include "instance.h"
+#include "sampler.h"
+#include "stats.h"
+
+void WavefrontIntegrator::PathQueue::push(const Vector& o, const Vector& d, const Color& thr, int pix, int dep, const Sampler& smp)
+{
+	if (size == (int)ox.size()) {
+		int n = size ? 2 * size : 1024;
+		ox.resize(n); oy.resize(n); oz.resize(n);
+		dx.resize(n); dy.resize(n); dz.resize(n);
+		thr_r.resize(n); thr_g.resize(n); thr_b.resize(n);
+		pixel.resize(n); depth.resize(n); sampler.resize(n);
+	}
+
+	ox[size] = o.x; oy[size] = o.y; oz[size] = o.z;
+	dx[size] = d.x; dy[size] = d.y; dz[size] = d.z;
+	thr_r[size] = thr.r(); thr_g[size] = thr.g(); thr_b[size] = thr.b();
+	pixel[size] = pix;
+	depth[size] = dep;
+	sampler[size] = smp;
+	size++;
+}
+
+void WavefrontIntegrator::ShadowQueue::push(const Vector& o, const Vector& d, const Color& l, int pix, Object* obj)
+{
+	if (size == (int)ox.size()) {
+		int n = size ? 2 * size : 1024;
+		ox.resize(n); oy.resize(n); oz.resize(n);
+		dx.resize(n); dy.resize(n); dz.resize(n);
+		l_r.resize(n); l_g.resize(n); l_b.resize(n);
+		pixel.resize(n); light.resize(n);
+	}
+
+	ox[size] = o.x; oy[size] = o.y; oz[size] = o.z;
+	dx[size] = d.x; dy[size] = d.y; dz[size] = d.z;
+	l_r[size] = l.r(); l_g[size] = l.g(); l_b[size] = l.b();
+	pixel[size] = pix;
+	light[size] = obj;
+	size++;
+}
+
+WavefrontIntegrator::WavefrontIntegrator(Scene* scene, TraceBatchFunc trace, const WavefrontSettings& settings)
+	: scene(scene), trace(trace), settings(settings)
+{
+	// the lights are found once instead of at every diffuse bounce
+	for (int i = 0; i < scene->getNumObjects(); i++) {
+		Object* obj = scene->getObject(i);
+		if (obj->GetMaterial()->GetEmission().sum() <= 0) continue;
+
+		Sphere* light = dynamic_cast<Sphere*>(obj);
+		if (light != NULL) lights.push_back(light);
+	}
+}
+
+void WavefrontIntegrator::render(const Tile& tile, float* out)
+{
+	int n_pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+	int n_samples = n_pixels * settings.spp;
+
+	accum.assign(3 * n_pixels, 0.0f);
+
+	// one wave of camera paths at a time, every path is followed until it terminates
+	for (int first = 0; first < n_samples; first += settings.wave_size) {
+		int n = MIN(settings.wave_size, n_samples - first);
+
+		generate(tile, first, n);
+
+		bool coherent = true;
+		while (paths.size > 0) {
+			extend(coherent);
+			shade();
+			connect();
+
+			swap(paths, next_paths);
+			coherent = false;
+		}
+	}
+
+	float inv_spp = 1.0f / settings.spp;
+	for (int i = 0; i < 3 * n_pixels; i++) {
+		out[i] = accum[i] * inv_spp;
+	}
+}
+
+// Camera rays of the samples [first, first + n[ of the tile (pixel by pixel, spp samples each)
+void WavefrontIntegrator::generate(const Tile& tile, int first, int n)
+{
+	Camera* camera = scene->GetCamera();
+	int width = tile.x1 - tile.x0;
+	Vector pixel, lens;
+	Color one(1.0f, 1.0f, 1.0f);
+	Sampler base(settings.sampler, settings.spp, settings.frame);
+
+	paths.clear();
+
+	for (int s = first; s < first + n; s++) {
+		int p = s / settings.spp;
+		int x = tile.x0 + p % width;
+		int y = tile.y0 + p / width;
+
+		Sampler sampler = base;
+		sampler.startSample(x, y, s % settings.spp);
+
+		float u, v;
+		sampler.get2D(u, v);
+		pixel.x = x + u;
+		pixel.y = y + v;
+
+		Ray ray;
+		if (settings.depth_of_field) {
+			if (settings.sample_disk) ray = camera->PrimaryRay(pixel, sampler);
+			else {
+				sampler.get2D(lens.x, lens.y);
+				ray = camera->PrimaryRay(lens, pixel);
+			}
+		}
+		else {
+			ray = camera->PrimaryRay(pixel);
+		}
+
+		paths.push(ray.origin, ray.direction, one, p, settings.max_depth, sampler);
+	}
+}
+
+// Closest hit of every queued path
+void WavefrontIntegrator::extend(bool coherent)
+{
+	Ray rays[TRACE_BATCH];
+
+	if ((int)hits.size() < paths.size) hits.resize(paths.size);
+
+	for (int first = 0; first < paths.size; first += TRACE_BATCH) {
+		int n = MIN(TRACE_BATCH, paths.size - first);
+
+		for (int k = 0; k < n; k++) rays[k] = paths.ray(first + k);
+		trace(rays, n, &hits[first], coherent);
+	}
+
+	STAT(coherent ? PrimaryRays : SecondaryRays, paths.size);
+
+	ray_count += paths.size;
+}
+
+// Material logic of every hit: emission and background go to the pixels, the scattered rays to the
+// next queue and the light samples to the shadow queue
+void WavefrontIntegrator::shade(void)
+{
+	next_paths.clear();
+	shadows.clear();
+
+	for (int i = 0; i < paths.size; i++) {
+		const HitRecord& hit = hits[i];
+		Ray ray = paths.ray(i);
+		Color thr(paths.thr_r[i], paths.thr_g[i], paths.thr_b[i]);
+		int pix = paths.pixel[i];
+		int depth = paths.depth[i];
+		Sampler sampler = paths.sampler[i];
+
+		if (hit.obj == NULL || depth == 0) {
+			accumulate(pix, thr * background(ray));
+			continue;
+		}
+
+		if (settings.test_intersect) {
+			accumulate(pix, thr * Color(1, 0, 0));
+			continue;
+		}
+
+		InstanceHit instance_hit;
+		Object* obj = instance_hit.resolve(hit.obj, ray);
+
+		Vector point = hit.point;
+		Vector norm = obj->getNormal(point);
+		Vector norml = (norm * ray.direction < 0) ? norm : norm * -1;
+
+		Vector intercept_out = point + norm * .0001;
+		Vector intercept_in = point - norm * .0001;
+
+		Material* mat = obj->GetMaterial();
+		Color f = mat->GetDiffColor();
+
+		//Russian Roulette
+		float p = MAX3(f.r(), f.g(), f.b());
+
+		if (--depth <= settings.max_depth - 5) {
+			if (sampler.get1D() < p) {
+				f = f * (1 / p);
+			}
+			else {
+				STAT(RouletteKills, 1);
+				accumulate(pix, thr * mat->GetEmission());
+				continue;
+			}
+		}
+
+		accumulate(pix, thr * mat->GetEmission());
+		Color thr_f = thr * f;
+
+		//Ideal diffuse reflection
+		if (mat->GetDiffuse() == 1.0f) {
+			float s1, s2;
+			sampler.get2D(s1, s2);
+
+			float r1 = 2 * PI * s1;
+			float r2 = s2;
+			float r2s = sqrt(r2);
+
+			Vector w = norml;
+			Vector u = (((fabs(w.x) > .1) ? Vector(0, 1, 0) : Vector(1, 0, 0)) % w).normalize();
+			Vector v = w % u;
+			Vector d = (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2)).normalize();
+
+			// next event estimation: one sample on the cone subtended by each light
+			for (size_t k = 0; k < lights.size(); k++) {
+				Sphere* light = lights[k];
+				Vector center = light->GetCenter();
+				float rad = light->GetRadius();
+
+				Vector sw = center - intercept_out;
+				Vector su = ((fabs(sw.x) > .1 ? Vector(0, 1, 0) : Vector(1, 0, 0)) % sw).normalize();
+				Vector sv = sw % su;
+
+				double cos_a_max = sqrt(1 - rad * rad / ((intercept_out - center) * (intercept_out - center)));
+
+				float eps1, eps2;
+				sampler.get2D(eps1, eps2);
+				double cos_a = 1 - eps1 + eps1 * cos_a_max;
+				double sin_a = sqrt(1 - cos_a * cos_a);
+				double phi = 2 * PI * eps2;
+
+				Vector l = (su * cos(phi) * sin_a + sv * sin(phi) * sin_a + sw * cos_a).normalize();
+
+				double omega = 2 * PI * (1 - cos_a_max);
+				Color emi = light->GetMaterial()->GetEmission();
+				Color contribution = thr_f * (emi * (l * norml) * omega) * (1 / PI);
+
+				shadows.push(intercept_out, l, contribution, pix, light);
+			}
+
+			// pushed after the light samples, the path carries on from the dimensions they used
+			next_paths.push(intercept_out, d, thr_f, pix, depth, sampler);
+			continue;
+		}
+
+		//Ideal specular reflection
+		Vector refl_dir = ray.direction - norm * (2 * (norm * ray.direction));
+
+		if (mat->GetSpecular() == 1.0f) {
+			next_paths.push(intercept_out, refl_dir, thr_f, pix, depth, sampler);
+			continue;
+		}
+
+		//Ideal dielectric
+		bool into = norm * norml > 0; // ray from outside?
+		double nc = 1.0f;
+		double nt = mat->GetRefrIndex();
+		double nnt = into ? nc / nt : nt / nc;
+		double ddn = ray.direction * norml;
+		double cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
+
+		if (cos2t < 0) { // Total internal reflection
+			next_paths.push(intercept_out, refl_dir, thr_f, pix, depth, sampler);
+			continue;
+		}
+
+		Vector tdir = (ray.direction * nnt - norm * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalize();
+		double a = nt - nc;
+		double b = nt + nc;
+		double R0 = (a * a) / (b * b);
+		double c = 1 - (into ? -ddn : tdir * norm);
+		double Re = R0 + (1 - R0) * c * c * c * c * c;
+		double Tr = 1 - Re;
+		double P = 0.25 + 0.5 * Re;
+		double RP = Re / P;
+		double TP = Tr / (1 - P);
+
+		// deep paths pick one of the two, near the camera both are followed
+		if (depth <= settings.max_depth - 2) {
+			if (sampler.get1D() < P) next_paths.push(intercept_out, refl_dir, thr_f * (float)RP, pix, depth, sampler);
+			else next_paths.push(intercept_out, tdir, thr_f * (float)TP, pix, depth, sampler);
+		}
+		else {
+			next_paths.push(intercept_out, refl_dir, thr_f * (float)Re, pix, depth, sampler);
+			next_paths.push(intercept_in, tdir, thr_f * (float)Tr, pix, depth, sampler.split());
+		}
+	}
+}
+
+// Traces the light samples, the ones that reach their light are added to the pixels
+void WavefrontIntegrator::connect(void)
+{
+	Ray rays[TRACE_BATCH];
+	HitRecord shadow_hits[TRACE_BATCH];
+
+	for (int first = 0; first < shadows.size; first += TRACE_BATCH) {
+		int n = MIN(TRACE_BATCH, shadows.size - first);
+
+		for (int k = 0; k < n; k++) rays[k] = shadows.ray(first + k);
+		trace(rays, n, shadow_hits, false);
+		STAT(ShadowRays, n);
+
+		for (int k = 0; k < n; k++) {
+			int s = first + k;
+			if (shadow_hits[k].obj == shadows.light[s]) {
+				accumulate(shadows.pixel[s], Color(shadows.l_r[s], shadows.l_g[s], shadows.l_b[s]));
+			}
+		}
+	}
+
+	ray_count += shadows.size;
+}
+
+void WavefrontIntegrator::accumulate(int pixel, Color l)
+{
+	accum[3 * pixel] += l.r();
+	accum[3 * pixel + 1] += l.g();
+	accum[3 * pixel + 2] += l.b();
+}
+
+Color WavefrontIntegrator::background(Ray& ray)
+{
+	if (settings.skybox) return scene->GetSkyboxColor(ray);
+	return scene->GetBackgroundColor();
+}
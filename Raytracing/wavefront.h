@@ -0,0 +1,98 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "scene.h"
+#include "sampler.h"
+#include "scheduler.h"
+
+using namespace std;
+
+// Closest hits of a batch of rays (coherent -> primary rays, which may be packet traced)
+typedef void (*TraceBatchFunc)(Ray* rays, int n, HitRecord* hits, bool coherent);
+
+struct WavefrontSettings {
+	int spp;			// samples per pixel
+	int max_depth;
+	int wave_size;		// camera paths generated per wave
+	sampler_type sampler;
+	bool depth_of_field;
+	bool sample_disk;
+	bool skybox;
+	bool test_intersect;
+	unsigned int frame;	// seeds the samples together with their pixel and index
+};
+
+// Wavefront (queue based) path tracer. Computes the same estimator as the recursive Radiance(),
+// but the paths of a whole wave are kept in SoA queues and advanced one bounce at a time through
+// separate stages: generate camera rays -> extend (closest hit) -> shade -> shadow connect -> accumulate.
+// Throughput is on par with the recursive integrator (within run to run noise on path_balls and
+// path_glass), the shade stage is still one material branch per path and is not sorted by material.
+// Not thread safe: every render thread owns its integrator (and queues)
+class WavefrontIntegrator
+{
+public:
+	WavefrontIntegrator(Scene* scene, TraceBatchFunc trace, const WavefrontSettings& settings);
+
+	// Renders a tile, out receives the (linear) rgb of its pixels in scanline order
+	void render(const Tile& tile, float* out);
+
+	// Rays traced (extension + shadow) since the last reset
+	uint64_t getRayCount(void) const { return ray_count; }
+	void resetRayCount(void) { ray_count = 0; }
+
+private:
+	// Path segments waiting to be extended
+	struct PathQueue {
+		vector<float> ox, oy, oz;
+		vector<float> dx, dy, dz;
+		vector<float> thr_r, thr_g, thr_b;	// path throughput
+		vector<int> pixel;					// index in the tile
+		vector<int> depth;
+		vector<Sampler> sampler;			// sample the path belongs to
+		int size = 0;
+
+		void clear(void) { size = 0; }
+		void push(const Vector& o, const Vector& d, const Color& thr, int pix, int dep, const Sampler& smp);
+		Ray ray(int i) const { return Ray(Vector(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i])); }
+	};
+
+	// Light samples: contribution is added to the pixel if the feeler hits the sampled light
+	struct ShadowQueue {
+		vector<float> ox, oy, oz;
+		vector<float> dx, dy, dz;
+		vector<float> l_r, l_g, l_b;
+		vector<int> pixel;
+		vector<Object*> light;
+		int size = 0;
+
+		void clear(void) { size = 0; }
+		void push(const Vector& o, const Vector& d, const Color& l, int pix, Object* obj);
+		Ray ray(int i) const { return Ray(Vector(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i])); }
+	};
+
+	static const int TRACE_BATCH = 64;
+
+	Scene* scene;
+	TraceBatchFunc trace;
+	WavefrontSettings settings;
+	vector<Sphere*> lights;		// emissive spheres, sampled by next event estimation
+
+	PathQueue paths, next_paths;
+	ShadowQueue shadows;
+	vector<HitRecord> hits;
+	vector<float> accum;		// rgb radiance sums of the tile pixels
+	uint64_t ray_count = 0;
+
+	void generate(const Tile& tile, int first_sample, int n);
+	void extend(bool coherent);
+	void shade(void);
+	void connect(void);
+	void accumulate(int pixel, Color l);
+
+	Color background(Ray& ray);
+};
+
+#endif